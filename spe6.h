@@ -0,0 +1,248 @@
+/* spe6.h
+ * Copyright 2024 Vraz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+ * FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* sp630e protocol definitions shared by spe6ctrl, spe6emu and --ring producers */
+
+#ifndef SPE6_H
+#define SPE6_H
+
+#include <stdint.h>
+#include <string.h>
+
+// gatt bluetooth types (no public header-- search "att-types.h")
+#define GATT_ERR_RSP          0x01
+#define GATT_MTU_REQ          0x02
+#define GATT_MTU_RSP          0x03
+#define GATT_FIND_INFO_REQ    0x04
+#define GATT_FIND_INFO_RSP    0x05
+#define GATT_FIND_BY_TYPE_VAL_REQ 0x06
+#define GATT_FIND_BY_TYPE_VAL_RSP 0x07
+#define GATT_READ_BY_TYPE_REQ 0x08
+#define GATT_READ_BY_TYPE_RSP 0x09
+#define GATT_READ_REQ         0x0a
+#define GATT_READ_RSP         0x0b
+#define GATT_READ_BLOB_REQ    0x0c
+#define GATT_READ_BLOB_RSP    0x0d
+#define GATT_READ_MULT_REQ    0x0e
+#define GATT_READ_MULT_RSP    0x0f
+#define GATT_READ_BY_GRP_TYPE_REQ  0x10
+#define GATT_READ_BY_GRP_TYPE_RSP  0x11
+#define GATT_WRITE_REQ        0x12
+#define GATT_WRITE_RSP        0x13
+#define GATT_WRITE_CMD        0x52
+#define GATT_SIGNED_WRITE_CMD  0xD2
+#define GATT_PREP_WRITE_REQ   0x16
+#define GATT_PREP_WRITE_RSP   0x17
+#define GATT_EXEC_WRITE_REQ   0x18
+#define GATT_EXEC_WRITE_RSP   0x19
+#define GATT_HAND_VAL_NOTIFY  0x1B
+#define GATT_HAND_VAL_IND     0x1D // IND??
+#define GATT_HAND_VAL_CONF    0x1E // CONF (CONFIG?)
+
+// sp630e attribute handles (0x0e=command/notify, 0x0f=notify config)
+#define SPE6_HANDLE_CMD       0x0e
+#define SPE6_HANDLE_CCC       0x0f
+
+// default att mtu (before exchange) and the mtu requested by spe6ctrl
+#define ATT_DEFAULT_MTU       23
+#define ATT_MAX_MTU           247
+
+// table of device fingerprints from 2902 query (width=query notify size delivered intact at default mtu)
+const static struct {
+  const char *kind;
+  uint8_t resp[16];
+  int width;
+} _ident[] = {
+    "SP630E-0", { 10, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x15, 0x00, 0x00, 0x00 }, 29,
+    "SP630E-1", { 10, 0x00, 0x00, 0x0f, 0x00, 0x01, 0x00, 0x15, 0x00, 0x00, 0x00 }, 29,
+};
+
+// query returns 77+rcnt*2 bytes (97 on factory fresh unit)
+struct sp630e {
+  uint8_t u0[1];     // 0x00: convenience uint8 pointer
+  uint8_t u1[4];     // 0x01: 0x01
+  uint8_t fw[8];     // 0x05: firmware version (V3.0.08 on my unit)
+  uint8_t u13[1];    // 0x0d: 0x80=factory 0x86=tester
+  uint8_t oo_effect; // 0x0e: onoff effect (1=fwd, 2=back, 3=fade, 4=stars)
+  uint8_t oo_speed;  // 0x0f: onoff speed (1..3)
+  uint8_t oo_len[2]; // 0x10: onoff len high:low (1..600)
+  uint8_t coexist;   // 0x12: allow rgb+white (why?)
+  uint8_t reboot;    // 0x13: power state on reboot (0=off, 1=on, 2=resume)
+
+  uint8_t u20[1];    // 0x14: 0x02
+  uint8_t u21[1];    // 0x15: 0x4b=factory 0x3b=tester
+  uint8_t u22[1];    // 0x16: 0x00
+  uint8_t power;     // 0x17: current power (0=off, 1=on)
+  uint8_t loop;      // 0x18: loop through effects (0=off, 1=on)
+  uint8_t order;     // 0x19: led order (0=brg,1=bgr,2=rbg,3=gbr,4=rgb,5=grb)
+  uint8_t mode;      // 0x1a: display mode (1/2=static, 3/4=dynamic, 5/6=sound, 7=custom)
+  uint8_t effect;    // 0x1b: effect within mode (over 130 effects for mode 3)
+  uint8_t u28[1];    // 0x1c:
+  uint8_t level;     // 0x1d: rgb color level
+  uint8_t white;     // 0x1e: white-led intensity
+  uint8_t rgb[3];    // 0x1f: static rgb color
+  uint8_t var34;     // 0x22: set by 0x61/0x5e for unknown purpose
+  uint8_t var35;     // 0x23: set by 0x61/0x5e for unknown purpose
+  uint8_t speed;     // 0x24: effect speed (1..10)
+  uint8_t len;       // 0x25: effect length (1..150)
+  uint8_t dir;       // 0x26: effect direction (0/1)
+  uint8_t gain;      // 0x27: microphone gain (0=disable, 1..255=gain)
+
+  uint8_t mic;       // 0x28: sound trigger (0=internal microphone, 1=pulse request)
+  uint8_t m_rgb[3];  // 0x29: rgb color for music mode even# effects
+  uint8_t var44;     // 0x2c: set by 0x60/0x5e for unknown urpose
+  uint8_t var45;     // 0x2d: set by 0x60/0x5e for unknown purpose
+  uint8_t u46[2];    // 0x2e:
+  struct {           // custom (mode 7) length+rgb data
+    uint8_t len;     // pixel length (1..?)
+    uint8_t rgb[3];  // color rgb
+  } cust[7];         // 0x30: list of seven custom colors
+  uint8_t rcnt;      // 0x4c: number of remote control mode+effects (factory=10)
+  uint8_t rme[20];   // 0x4d: remote-control mode+effect pairs (10 pairs max)
+};
+
+// apply command parms to parm memory (as the controller does)
+// parm points at the byte following the parm count (bulk parms 9..11 land in m_rgb for music modes)
+static inline void sp630e_apply(struct sp630e *sp, uint8_t code, const uint8_t *parm, int cnt)
+{
+  uint8_t *bulk[] = { &sp->mode, &sp->effect, &sp->level, &sp->speed, &sp->len, &sp->dir, &sp->var44, &sp->var45,
+      &sp->rgb[0], &sp->rgb[1], &sp->rgb[2], &sp->var34, &sp->var35 };
+  switch (code) {
+  case 0x08: // onoff
+    if (cnt >= 5) {
+      sp->oo_effect = parm[1];
+      sp->oo_speed = parm[2];
+      sp->oo_len[0] = parm[3];
+      sp->oo_len[1] = parm[4];
+    }
+    break;
+  case 0x0a: if (cnt >= 1) sp->coexist = parm[0]; break;
+  case 0x0b: if (cnt >= 1) sp->reboot = parm[0]; break;
+  case 0x50: if (cnt >= 1) sp->power = parm[0]; break;
+  case 0x51: // level (0=color, 1=white)
+    if (cnt >= 2)
+      *(parm[0] ? &sp->white : &sp->level) = parm[1];
+    break;
+  case 0x52: // rgb
+    if (cnt >= 4) {
+      memcpy(sp->rgb, parm, 3);
+      sp->level = parm[3];
+    }
+    break;
+  case 0x53: // mode [effect]
+    if (cnt >= 1)
+      sp->mode = parm[0];
+    if (cnt >= 2)
+      sp->effect = parm[1];
+    break;
+  case 0x54: if (cnt >= 1) sp->speed = parm[0]; break;
+  case 0x55: if (cnt >= 1) sp->len = parm[0]; break;
+  case 0x56: if (cnt >= 1) sp->dir = parm[0]; break;
+  case 0x57: if (cnt >= 3) memcpy(sp->m_rgb, parm, 3); break;
+  case 0x58: if (cnt >= 1) sp->loop = parm[0]; break;
+  case 0x59: if (cnt >= 1) sp->mic = parm[0]; break;
+  case 0x5a: if (cnt >= 1) sp->gain = parm[0]; break;
+  case 0x5c: // remote mode+effect pairs (resizes parm memory)
+    sp->rcnt = (cnt > sizeof(sp->rme)) ? sizeof(sp->rme)/2 : cnt/2;
+    memset(sp->rme, 0, sizeof(sp->rme));
+    memcpy(sp->rme, parm, sp->rcnt*2);
+    break;
+  case 0x5e: // bulk/static/dynamic/music
+    if ((cnt >= 1) && ((parm[0] == 5) || (parm[0] == 6)))
+      bulk[8] = &sp->m_rgb[0], bulk[9] = &sp->m_rgb[1], bulk[10] = &sp->m_rgb[2];
+    for (int i = 0; (i < cnt) && (i < sizeof(bulk)/sizeof(bulk[0])); ++i)
+      *bulk[i] = parm[i];
+    break;
+  case 0x60: // var44 [var45]
+    if (cnt >= 1)
+      sp->var44 = parm[0];
+    if (cnt >= 2)
+      sp->var45 = parm[1];
+    break;
+  case 0x61: // var34 [var35]
+    if (cnt >= 1)
+      sp->var34 = parm[0];
+    if (cnt >= 2)
+      sp->var35 = parm[1];
+    break;
+  case 0x62: if (cnt >= 1) sp->mode = parm[0]; break;
+  case 0x63: // custom (leading 1 then len:r:g:b groups)
+    for (int i = 0; i < sizeof(sp->cust)/sizeof(sp->cust[0]); ++i)
+      memcpy(&sp->cust[i], (1+i*4+4 <= cnt) ? parm+1+i*4 : (const uint8_t *)"\0\0\0", 4);
+    break;
+  case 0x6b: if (cnt >= 1) sp->order = parm[0]; break;
+  }
+}
+
+// binary command ring (spe6ctrl --ring=path maps the file, one local producer process submits)
+// producer fills slot[head%slots] with status SPE6_PENDING then publishes by advancing head,
+// spe6ctrl takes slots in order advancing tail and writes the result into status once the controller responds
+// (a slot is reusable once tail has passed it and its status is no longer SPE6_PENDING)
+#define SPE6_RING_MAGIC 0x72367073  // "sp6r"
+enum { SPE6_FREE = 0, SPE6_PENDING = 1, SPE6_OK = 2, SPE6_EINVAL = -1, SPE6_EFULL = -2, SPE6_ECONN = -3,
+    SPE6_ETIMEOUT = -4, SPE6_ERESP = -5, SPE6_EDEADLINE = -6, SPE6_EFAIL = -7 };
+struct spe6_slot {
+  uint32_t seq;      // producer sequence (head when published)
+  int32_t status;    // SPE6_* (written by spe6ctrl once done)
+  uint8_t dev;       // device index (bt-addr order given to spe6ctrl)
+  uint8_t code;      // opcode (0x53 frame byte 4)
+  uint8_t cnt;       // parm count (frame byte 8)
+  uint8_t prio;      // priority class (0=interactive, 1=normal, 2=background)
+  uint16_t deadline; // ms after spe6ctrl takes the slot before it is dropped rather than sent (0=none)
+  uint8_t parm[34];  // parms (frame bytes 9..)
+};
+struct spe6_ring {
+  uint32_t magic;    // SPE6_RING_MAGIC once spe6ctrl has initialized the ring
+  uint32_t slots;    // slot count (power of 2)
+  uint32_t ndev;     // devices addressable by slot dev
+  uint32_t head __attribute__((aligned(64)));  // slots published (producer writes)
+  uint32_t tail __attribute__((aligned(64)));  // slots taken (spe6ctrl writes)
+  struct spe6_slot slot[] __attribute__((aligned(64)));
+};
+
+// producer: submit command (returns sequence, -1=ring full)
+static inline int64_t spe6_ring_put(struct spe6_ring *r, int dev, int prio, int deadline, int code, const uint8_t *parm, int cnt)
+{
+  uint32_t head = r->head;
+  struct spe6_slot *s = &r->slot[head&(r->slots-1)];
+  if ((head-__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= r->slots) ||
+      (__atomic_load_n(&s->status, __ATOMIC_ACQUIRE) == SPE6_PENDING) || (cnt > sizeof(s->parm)))
+    return -1;
+  s->seq = head;
+  s->dev = dev;
+  s->prio = prio;
+  s->deadline = deadline;
+  s->code = code;
+  s->cnt = cnt;
+  memcpy(s->parm, parm, cnt);
+  s->status = SPE6_PENDING;
+  __atomic_store_n(&r->head, head+1, __ATOMIC_RELEASE);
+  return head;
+}
+
+// producer: status of submitted command (SPE6_PENDING until done, SPE6_FREE once slot reused)
+static inline int spe6_ring_status(struct spe6_ring *r, uint32_t seq)
+{
+  struct spe6_slot *s = &r->slot[seq&(r->slots-1)];
+  int status = __atomic_load_n(&s->status, __ATOMIC_ACQUIRE);
+  return (s->seq == seq) ? status : SPE6_FREE;
+}
+
+#endif
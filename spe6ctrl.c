@@ -19,7 +19,9 @@
  */
 
 /* notes:
-   compile via: gcc -g -O0 spe6ctrl.c -o spe6ctrl -lbluetooth
+   compile via: gcc -g -O0 -pthread spe6ctrl.c -o spe6ctrl -lbluetooth -lm
+     (or -DNO_BLUETOOTH without -lbluetooth for emulated controllers only)
+   unix:<path> (or /path) in place of bt-addr talks to spe6emu rather than hardware
    tested on spe630e w/V3.0.08 firmware
    general use: len=controllers/meter, speed=5
    good remote mode+effect (modified by speed+len+dir):
@@ -36,113 +38,67 @@
    0x60: what do var44/var45 control?
    0x61: what do var34/var35 control?
    0x62: must be more than mode change
-   translation from video rgb to led rgb 
+   translation from video rgb to led rgb (--video-cal gamma 2.2 is a starting point, white balance per strip)
    how to set remote control zone number
-   determine pulse parameters
+   determine pulse parameters (--audio sends onset strength + 6 band levels as a guess)
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <signal.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <time.h>
+#include <math.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <pthread.h>
+#ifndef NO_BLUETOOTH
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
+#endif
 
-// gatt bluetooth types (no public header-- search "att-types.h")
-#define GATT_ERR_RSP          0x01
-#define GATT_MTU_REQ          0x02
-#define GATT_MTU_RSP          0x03
-#define GATT_FIND_INFO_REQ    0x04
-#define GATT_FIND_INFO_RSP    0x05
-#define GATT_FIND_BY_TYPE_VAL_REQ 0x06
-#define GATT_FIND_BY_TYPE_VAL_RSP 0x07
-#define GATT_READ_BY_TYPE_REQ 0x08
-#define GATT_READ_BY_TYPE_RSP 0x09
-#define GATT_READ_REQ         0x0a
-#define GATT_READ_RSP         0x0b
-#define GATT_READ_BLOB_REQ    0x0c
-#define GATT_READ_BLOB_RSP    0x0d
-#define GATT_READ_MULT_REQ    0x0e
-#define GATT_READ_MULT_RSP    0x0f
-#define GATT_READ_BY_GRP_TYPE_REQ  0x10
-#define GATT_READ_BY_GRP_TYPE_RSP  0x11
-#define GATT_WRITE_REQ        0x12
-#define GATT_WRITE_RSP        0x13
-#define GATT_WRITE_CMD        0x52
-#define GATT_SIGNED_WRITE_CMD  0xD2
-#define GATT_PREP_WRITE_REQ   0x16
-#define GATT_PREP_WRITE_RSP   0x17
-#define GATT_EXEC_WRITE_REQ   0x18
-#define GATT_EXEC_WRITE_RSP   0x19
-#define GATT_HAND_VAL_NOTIFY  0x1B
-#define GATT_HAND_VAL_IND     0x1D // IND??
-#define GATT_HAND_VAL_CONF    0x1E // CONF (CONFIG?)
-
-#define CONN_TIMEOUT 10
-
-// table of device fingerprints from 2902 query
-const static struct {
-  const char *kind;
-  uint8_t resp[16];
-} _ident[] = {
-    "SP630E-0", { 10, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x15, 0x00, 0x00, 0x00 },
-    "SP630E-1", { 10, 0x00, 0x00, 0x0f, 0x00, 0x01, 0x00, 0x15, 0x00, 0x00, 0x00 },
-};
-
-// query returns 77+rcnt*2 bytes (97 on factory fresh unit)
-static struct sp630e {
-  uint8_t u0[1];     // 0x00: convenience uint8 pointer
-  uint8_t u1[4];     // 0x01: 0x01
-  uint8_t fw[8];     // 0x05: firmware version (V3.0.08 on my unit)
-  uint8_t u13[1];    // 0x0d: 0x80=factory 0x86=tester
-  uint8_t oo_effect; // 0x0e: onoff effect (1=fwd, 2=back, 3=fade, 4=stars)
-  uint8_t oo_speed;  // 0x0f: onoff speed (1..3)
-  uint8_t oo_len[2]; // 0x10: onoff len high:low (1..600)
-  uint8_t coexist;   // 0x12: allow rgb+white (why?)
-  uint8_t reboot;    // 0x13: power state on reboot (0=off, 1=on, 2=resume)
-
-  uint8_t u20[1];    // 0x14: 0x02
-  uint8_t u21[1];    // 0x15: 0x4b=factory 0x3b=tester
-  uint8_t u22[1];    // 0x16: 0x00
-  uint8_t power;     // 0x17: current power (0=off, 1=on)
-  uint8_t loop;      // 0x18: loop through effects (0=off, 1=on)
-  uint8_t order;     // 0x19: led order (0=brg,1=bgr,2=rbg,3=gbr,4=rgb,5=grb)
-  uint8_t mode;      // 0x1a: display mode (1/2=static, 3/4=dynamic, 5/6=sound, 7=custom)
-  uint8_t effect;    // 0x1b: effect within mode (over 130 effects for mode 3)
-  uint8_t u28[1];    // 0x1c:
-  uint8_t level;     // 0x1d: rgb color level
-  uint8_t white;     // 0x1e: white-led intensity
-  uint8_t rgb[3];    // 0x1f: static rgb color
-  uint8_t var34;     // 0x22: set by 0x61/0x5e for unknown purpose
-  uint8_t var35;     // 0x23: set by 0x61/0x5e for unknown purpose
-  uint8_t speed;     // 0x24: effect speed (1..10)
-  uint8_t len;       // 0x25: effect length (1..150)
-  uint8_t dir;       // 0x26: effect direction (0/1)
-  uint8_t gain;      // 0x27: microphone gain (0=disable, 1..255=gain)
-
-  uint8_t mic;       // 0x28: sound trigger (0=internal microphone, 1=pulse request)
-  uint8_t m_rgb[3];  // 0x29: rgb color for music mode even# effects
-  uint8_t var44;     // 0x2c: set by 0x60/0x5e for unknown urpose
-  uint8_t var45;     // 0x2d: set by 0x60/0x5e for unknown purpose
-  uint8_t u46[2];    // 0x2e:
-  struct {           // custom (mode 7) length+rgb data
-    uint8_t len;     // pixel length (1..?)
-    uint8_t rgb[3];  // color rgb
-  } cust[7];         // 0x30: list of seven custom colors
-  uint8_t rcnt;      // 0x4c: number of remote control mode+effects (factory=10)
-  uint8_t rme[20];   // 0x4d: remote-control mode+effect pairs (10 pairs max)
-} _sp = { 0 }, _pr = { 0 };
+#include "spe6.h"
 
-static struct {
-  int off;           // current offset into parm query (0=not in progress)
-  int cnt;           // count of queries (0=no query yet)
-} _qs = { 0 };
+#define CONN_TIMEOUT 10    // seconds
+#define RESP_TIMEOUT 5     // seconds
+#define MTU_TIMEOUT 500    // ms to wait for mtu exchange (then assume default)
+#define IDENT_TIMEOUT 500  // ms per identify attempt
+#define IDENT_RETRY 4      // identify attempts before reconnect
+#define NOTIFY_TIMEOUT 1000 // ms
+#define QUERY_TIMEOUT 1000 // ms per parm query attempt
+#define QUERY_RETRY 3      // parm query attempts (segments received are kept between attempts)
+#define REPLAY_MAX 3       // sends of a request interrupted by disconnect
+#define HOLD_TIMEOUT 10    // seconds a request waits for reconnect
+#define BACKOFF_BASE 100   // ms before second reconnect attempt (doubles per failure)
+#define BACKOFF_MAX 5000   // ms
+#define MAX_CLIENT 16
+#define MAX_DEVICE 32
+#define MAX_QUEUE 64       // queued requests per device (after coalescing)
+#define MAX_SCENE 4        // scenes staged at once
+#define RATE_INIT 10       // commands/s until a controller's safe rate is learned
+#define RATE_MIN 2         // commands/s
+#define RATE_MAX 200       // commands/s
+#define RATE_SLOW 20       // ms beyond twice the fastest response that counts as slow
+#define RING_SLOTS 256     // default binary command ring size
+#define RING_POLL 1000     // us between binary command ring polls while commands are arriving
+#define RING_IDLE 1000     // ms without commands before the ring is polled at RING_IDLE_POLL
+#define RING_IDLE_POLL 50  // ms between binary command ring polls while idle
+#define HIST_BUCKETS 24    // log2 latency buckets (<=1us .. <=4.2s, then longer)
+#define METRIC_OPS 16      // opcodes with their own write latency histogram (last slot takes the rest)
+#define TRACE_RING (1<<20) // trace capture buffer (bytes, power of 2)
+#define TRACE_FLUSH 50     // ms between trace buffer flushes
+#define TRACE_AHEAD 8      // recorded sends searched for a match during replay
 
 // simple command table
 struct command {
@@ -186,68 +142,579 @@ static const struct command cmdlist[] = {
   "order",   "",   1, 1, 0x6b, "<0=brg|1=bgr|2=rbg|3=gbr|4=rgb|5=grb>", "set led order (works during animation)",
   "ref",     "",   3, 3, 0x6c, "<0..255=led1> <0..255=led2> <0..255=led3>", "show static color without order correction (likely for setup)",
   "set",   "a0",   1, 1, 0x51, "<0..255=level>", "set the level (all modes)",
-  "inc",  "a0m",   1, 1, 0x51, "<0..255=level>", "increase level unless already higher (must query first)",
-  "dec",  "a0m",   1, 1, 0x51, "<0..255=level>", "decrease level unless already lower (must query first)",
+  "inc",  "a0m",   1, 1, 0x51, "<0..255=level>", "increase level unless already higher (queries first if cache stale)",
+  "dec",  "a0m",   1, 1, 0x51, "<0..255=level>", "decrease level unless already lower (queries first if cache stale)",
   "", "", 0, 0, 0
 };
 
-// configuration display format
+// configuration display format (offset into struct sp630e)
 const struct {
-  void *pr, *sp; int len; char *key, *fmt;
+  int off; int len; char *key, *fmt;
 } format[] = {
-  &_pr.fw, &_sp.fw, 8, "fw", "%.8s",
-  NULL, NULL, 0, NULL, "\n",
-  &_pr.power, &_sp.power, 1, "power", "%d",
-  &_pr.reboot, &_sp.reboot, 1, "reboot", "%d",
-  &_pr.order, &_sp.order, 1, "order", "%d",
-  &_pr.oo_effect, &_sp.oo_effect, 1, "oo_effect", "%d",
-  &_pr.oo_speed, &_sp.oo_speed, 1, "oo_speed", "%d",
-  &_pr.oo_len, &_sp.oo_len, 2, "oo_len", "%02x%02x",
-  &_pr.mode, &_sp.mode, 1, "mode", "%d",
-  &_pr.effect, &_sp.effect, 1, "effect", "%d",
-  &_pr.speed, &_sp.speed, 1, "speed", "%d",
-  &_pr.len, &_sp.len, 1, "len", "%d",
-  &_pr.dir, &_sp.dir, 1, "dir", "%d",
-  &_pr.loop, &_sp.loop, 1, "loop", "%d",
-  &_pr.rgb, &_sp.rgb, 3, "rgb", "%02x:%02x:%02x",
-  &_pr.var34, &_sp.var34, 1, "var34", "%d",
-  &_pr.var35, &_sp.var35, 1, "var35", "%d",
-  &_pr.level, &_sp.level, 1, "level", "%d",
-  &_pr.white, &_sp.white, 1, "white", "%d",
-  &_pr.gain, &_sp.gain, 1, "gain", "%d",
-  &_pr.mic, &_sp.mic, 1, "mic", "%d",
-  &_pr.m_rgb, &_sp.m_rgb, 3, "m_rgb", "%02x:%02x:%02x",
-  &_pr.var44, &_sp.var44, 1, "var44", "%d",
-  &_pr.var45, &_sp.var45, 1, "var45", "%d",
-  NULL, NULL, 0, NULL, "\n",
-  &_pr.cust[0], &_sp.cust[0], 4, "cust0", "%d/%02x:%02x:%02x",
-  &_pr.cust[1], &_sp.cust[1], 4, "cust1", "%d/%02x:%02x:%02x",
-  &_pr.cust[2], &_sp.cust[2], 4, "cust2", "%d/%02x:%02x:%02x",
-  &_pr.cust[3], &_sp.cust[3], 4, "cust3", "%d/%02x:%02x:%02x",
-  &_pr.cust[4], &_sp.cust[4], 4, "cust4", "%d/%02x:%02x:%02x",
-  &_pr.cust[5], &_sp.cust[5], 4, "cust5", "%d/%02x:%02x:%02x",
-  &_pr.cust[6], &_sp.cust[6], 4, "cust6", "%d/%02x:%02x:%02x",
-  NULL, NULL, 0, NULL, "\n",
-  &_pr.rcnt, &_sp.rcnt, 1, "rcnt", "%d",
-  &_pr.rme[0],  &_sp.rme[0],  2, "rme0", "%d:%d",
-  &_pr.rme[2],  &_sp.rme[2],  2, "rme1", "%d:%d",
-  &_pr.rme[4],  &_sp.rme[4],  2, "rme2", "%d:%d",
-  &_pr.rme[6],  &_sp.rme[6],  2, "rme3", "%d:%d",
-  &_pr.rme[8],  &_sp.rme[8],  2, "rme4", "%d:%d",
-  &_pr.rme[10], &_sp.rme[10], 2, "rme5", "%d:%d",
-  &_pr.rme[12], &_sp.rme[12], 2, "rme6", "%d:%d",
-  &_pr.rme[14], &_sp.rme[14], 2, "rme7", "%d:%d",
-  &_pr.rme[16], &_sp.rme[16], 2, "rme8", "%d:%d",
-  &_pr.rme[18], &_sp.rme[18], 2, "rme9", "%d:%d",
-  NULL, NULL, 0, NULL, NULL
+  offsetof(struct sp630e, fw), 8, "fw", "%.8s",
+  -1, 0, NULL, "\n",
+  offsetof(struct sp630e, power), 1, "power", "%d",
+  offsetof(struct sp630e, reboot), 1, "reboot", "%d",
+  offsetof(struct sp630e, order), 1, "order", "%d",
+  offsetof(struct sp630e, oo_effect), 1, "oo_effect", "%d",
+  offsetof(struct sp630e, oo_speed), 1, "oo_speed", "%d",
+  offsetof(struct sp630e, oo_len), 2, "oo_len", "%02x%02x",
+  offsetof(struct sp630e, mode), 1, "mode", "%d",
+  offsetof(struct sp630e, effect), 1, "effect", "%d",
+  offsetof(struct sp630e, speed), 1, "speed", "%d",
+  offsetof(struct sp630e, len), 1, "len", "%d",
+  offsetof(struct sp630e, dir), 1, "dir", "%d",
+  offsetof(struct sp630e, loop), 1, "loop", "%d",
+  offsetof(struct sp630e, rgb), 3, "rgb", "%02x:%02x:%02x",
+  offsetof(struct sp630e, var34), 1, "var34", "%d",
+  offsetof(struct sp630e, var35), 1, "var35", "%d",
+  offsetof(struct sp630e, level), 1, "level", "%d",
+  offsetof(struct sp630e, white), 1, "white", "%d",
+  offsetof(struct sp630e, gain), 1, "gain", "%d",
+  offsetof(struct sp630e, mic), 1, "mic", "%d",
+  offsetof(struct sp630e, m_rgb), 3, "m_rgb", "%02x:%02x:%02x",
+  offsetof(struct sp630e, var44), 1, "var44", "%d",
+  offsetof(struct sp630e, var45), 1, "var45", "%d",
+  -1, 0, NULL, "\n",
+  offsetof(struct sp630e, cust[0]), 4, "cust0", "%d/%02x:%02x:%02x",
+  offsetof(struct sp630e, cust[1]), 4, "cust1", "%d/%02x:%02x:%02x",
+  offsetof(struct sp630e, cust[2]), 4, "cust2", "%d/%02x:%02x:%02x",
+  offsetof(struct sp630e, cust[3]), 4, "cust3", "%d/%02x:%02x:%02x",
+  offsetof(struct sp630e, cust[4]), 4, "cust4", "%d/%02x:%02x:%02x",
+  offsetof(struct sp630e, cust[5]), 4, "cust5", "%d/%02x:%02x:%02x",
+  offsetof(struct sp630e, cust[6]), 4, "cust6", "%d/%02x:%02x:%02x",
+  -1, 0, NULL, "\n",
+  offsetof(struct sp630e, rcnt), 1, "rcnt", "%d",
+  offsetof(struct sp630e, rme[0]),  2, "rme0", "%d:%d",
+  offsetof(struct sp630e, rme[2]),  2, "rme1", "%d:%d",
+  offsetof(struct sp630e, rme[4]),  2, "rme2", "%d:%d",
+  offsetof(struct sp630e, rme[6]),  2, "rme3", "%d:%d",
+  offsetof(struct sp630e, rme[8]),  2, "rme4", "%d:%d",
+  offsetof(struct sp630e, rme[10]), 2, "rme5", "%d:%d",
+  offsetof(struct sp630e, rme[12]), 2, "rme6", "%d:%d",
+  offsetof(struct sp630e, rme[14]), 2, "rme7", "%d:%d",
+  offsetof(struct sp630e, rme[16]), 2, "rme8", "%d:%d",
+  offsetof(struct sp630e, rme[18]), 2, "rme9", "%d:%d",
+  -1, 0, NULL, NULL
+};
+
+// request priority classes (queue ordered by class, fifo within a class)
+enum { PRIO_INTERACTIVE, PRIO_NORMAL, PRIO_BACKGROUND, PRIO_MAX };
+static const char *_prio[] = { "interactive", "normal", "background" };
+
+// queued command request (from command-line, console or daemon client)
+struct request {
+  struct request *next;
+  struct client *cl; // requesting daemon client (NULL=command-line/console)
+  char name[16];     // command name (for response)
+  int64_t queued;    // time first queued (us)
+  int64_t sent;      // time sent (us)
+  int64_t deadline;  // time after which it is dropped rather than sent (us, 0=none)
+  int prio;          // PRIO_*
+  int tries;         // sends interrupted by disconnect
+  int cond;          // level condition checked before sending (1=inc, -1=dec)
+  int quiet;         // internal request (no output)
+  struct plan *plan; // desired state expanded into commands at send time (want)
+  struct scene *sc;  // scene write (result reported by scene)
+  struct spe6_slot *slot; // binary ring command (status written back)
+  int len;           // request length
+  uint8_t req[48];   // gatt write request
+};
+
+// desired parms from want (set marks bytes given)
+struct plan {
+  struct sp630e sp;
+  uint8_t set[sizeof(struct sp630e)];
+};
+
+// host-rendered animation timeline (frames sent as rgb at the engine frame rate)
+enum { ANIM_NONE, ANIM_FADE, ANIM_BREATHE, ANIM_CYCLE, ANIM_VIDEO };
+static const char *_animkind[] = { "none", "fade", "breathe", "cycle", "video" };
+// led channel order (order parm 0=brg,1=bgr,2=rbg,3=gbr,4=rgb,5=grb) as r/g/b index per led channel
+static const uint8_t _order[6][3] = { { 2, 0, 1 }, { 2, 1, 0 }, { 0, 2, 1 }, { 1, 2, 0 }, { 0, 1, 2 }, { 1, 0, 2 } };
+struct anim {
+  int kind;          // ANIM_*
+  int ncolor;        // keyframe colors
+  uint8_t color[8][3];
+  int64_t start;     // timeline start (us)
+  int64_t step;      // us per keyframe (fade/cycle) or per breath
+  uint8_t last[4];   // last frame sent (unchanged frames are not resent)
+  int64_t frames;    // frames sent
+  int64_t dropped;   // frames dropped (link busy or ticks missed)
+  int64_t ticks;     // engine ticks while active
+  int64_t jsum, jmax; // tick jitter (us)
+  int region;        // video region shown (VIDEO_*)
+  int wait;          // fade start color waiting on a query of the controller (timeline starts once known)
+};
+
+// shadow of controller parm memory (per-address cache file shared by every spe6ctrl run)
+#define SHADOW_MAGIC 0x36657073  // "spe6"
+struct shadow {
+  uint32_t magic;    // SHADOW_MAGIC (layout check)
+  uint32_t size;     // sizeof(struct shadow)
+  int64_t queried;   // wall time of last query (ms, 0=never)
+  int64_t updated;   // wall time of last query or sent command (ms)
+  int ident;         // _ident index+1 from last identify (0=unknown)
+  int mtu;           // mtu from last exchange (0=unknown, default=no exchange support)
+  float rate;        // learned command rate (commands/s, 0=not learned)
+  float cwnd;        // learned writes per confirmed batch (0=not learned)
+  char fw[8];        // firmware the rate was learned on
+  struct sp630e qr;  // parm memory from last query
+  struct sp630e sp;  // last query with commands sent since applied
+};
+
+// controller transport (selected by address form)
+struct transport {
+  const char *name;
+  int (*open)(const char *addr);  // start non-blocking connect (returns socket or -1)
+  ssize_t (*send)(int sock, const void *buf, size_t len);
+  ssize_t (*recv)(int sock, void *buf, size_t len);
+  void (*close)(int sock);
+};
+
+// latency histogram (bucket i counts samples <= 2^i us)
+struct hist {
+  uint64_t cnt, sum; // samples, total us
+  uint64_t b[HIST_BUCKETS];
 };
 
-// send commands to controller (cmdline format: cmd <arg1> <arg2> ... <argn>)
-void cmdline(char *line, int sock)
+// per-controller link health (updated with relaxed atomics, exported in prometheus text format)
+struct metrics {
+  uint64_t connects, connfail, disconnects, identretry, timeouts, errors, queries, notifies;
+  struct hist connect; // connect start to ready
+  struct hist query;   // query send to reassembled
+  struct {
+    int code;        // opcode (0=unused)
+    struct hist h;   // write to response
+  } write[METRIC_OPS];
+};
+#define METRIC_ADD(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+
+// session trace file (header then records, each record header followed by len data bytes)
+#define TRACE_MAGIC 0x74367073 // "sp6t"
+enum { TR_DEV, TR_SHADOW, TR_OPEN, TR_SEND, TR_RECV, TR_CLOSE, TR_REQ };
+struct trace_hdr {
+  uint32_t magic;    // TRACE_MAGIC
+  uint32_t version;  // 1
+  int64_t wall;      // wall time capture started (ms)
+};
+struct trace_rec {
+  int64_t t;         // time since capture started (us, monotonic)
+  uint16_t len;      // data bytes following
+  uint8_t dev;       // device index (0xff=none)
+  uint8_t type;      // TR_*
+};
+
+// per-controller connection state machine (advances on responses, per-state timeouts)
+// down -> connect -> mtu -> identify -> notify -> ready <-> busy (failures drop back to down)
+enum { DEV_DOWN, DEV_CONNECT, DEV_MTU, DEV_IDENTIFY, DEV_NOTIFY, DEV_READY, DEV_BUSY };
+static const char *_state[] = { "down", "connect", "mtu", "identify", "notify", "ready", "busy" };
+static struct device {
+  char addr[108];    // bt-addr (or unix:path of emulated controller)
+  const struct transport *tp;
+  int sock;          // transport socket (-1=disconnected)
+  int state;         // connection state (DEV_*)
+  int64_t timer;     // state timeout (ms)
+  int retry;         // attempts in current state
+  const char *kind;  // device kind from 2902 query (NULL=unidentified)
+  int safe;          // query width delivered intact at default mtu (from kind)
+  int mtu;           // negotiated att mtu
+  int wok;           // widest query width delivered intact (0=none yet)
+  int wbad;          // narrowest query width that failed (0=none yet)
+  struct sp630e sp;  // parm memory from latest query
+  struct sp630e pr;  // parm memory from previous query (for diff)
+  struct shadow *sh; // cached parm memory (mmap'd file or memory)
+  struct {
+    int active;      // parm query in progress
+    int cnt;         // count of queries (0=no query yet)
+    int width;       // notify width of query in progress
+    int seglen;      // data bytes per segment (all but final segment)
+    int tries;       // attempts at query in progress
+    uint32_t have[8]; // bitmap of received segments
+    uint8_t buf[sizeof(struct sp630e)]; // reassembly buffer
+  } qs;
+  struct request *rqhead, *rqtail;
+  struct request *busy; // request batch awaiting response
+  int64_t rtt;       // latest request-to-response time (us)
+  int64_t rttmin;    // fastest write response this connection (us, 0=none yet)
+  int64_t pace;      // earliest next send (us, rate limiter)
+  int limited;       // requests held back by rate or window since last response
+  struct {
+    int64_t sent, expired;
+    int64_t wsum, wmax; // queued-to-sent wait (us)
+  } pq[PRIO_MAX];    // per priority class stats
+  int64_t connstart; // time connect started (us, 0=counted)
+  struct metrics met;
+  int fails;         // reconnects since the link last proved healthy (backoff)
+  int park;          // only used by reconcile (disconnected between rounds)
+  struct anim an;    // host-rendered animation
+} _dev[MAX_DEVICE];
+static int _ndev = 0;
+
+// daemon client connection
+static struct client {
+  int fd;            // unix socket (-1=unused)
+  FILE *fp;          // response stream
+  int len;           // buffered request length
+  char buf[4096];    // partial request line
+} _cl[MAX_CLIENT];
+
+// fleet reconcile (desired parms per address from file, drift pushed with bounded concurrency)
+enum { RC_WAIT, RC_ACTIVE, RC_DONE };
+static struct reconcile {
+  const char *file;  // desired parms (NULL=off)
+  int interval;      // seconds between rounds (0=once)
+  int limit;         // devices reconciled at once
+  int64_t next;      // next round (ms, 0=none)
+  int64_t start;     // current round start (us, 0=none)
+  int drifted, failed;
+  int n;             // devices in current round
+  struct rcdev {
+    struct device *dev;
+    struct plan want; // desired parms
+    int state;       // RC_*
+    int64_t start;   // wall time reconcile started (ms)
+  } m[MAX_DEVICE];
+} _rc = { .limit = 4 };
+
+// write applied to several devices together (staged until all are idle, then fired so writes land together)
+static struct scene {
+  int n;             // devices (0=unused)
+  struct client *cl; // requesting daemon client (NULL=command-line/console)
+  char name[16];     // command name (for response)
+  int64_t start;     // time staged (us)
+  int fired;         // send times planned
+  int left;          // writes not yet responded
+  char err[192];     // first failure (bt-addr and reason)
+  struct scene_dev {
+    struct device *dev;
+    struct request *rq; // staged write (NULL once sent)
+    int64_t at;      // planned send (us, slow links first so writes arrive together)
+    int64_t rtt;     // link rtt when planned (us)
+    int64_t sent, acked;
+  } m[MAX_DEVICE];
+} _scene[MAX_SCENE];
+
+static int _epfd = -1;
+static int _window = 1;
+static const char *_cache = "/tmp";  // shadow cache directory (NULL=memory only)
+static int _stale = 300;             // seconds before cached parms need a fresh query
+static int _probe = 30;              // idle seconds before liveness probe (0=none)
+static int _fps = 20;                // animation frame rate
+static int _animfd = -1;             // animation frame timer (timerfd)
+static int64_t _animtick = 0;        // time of previous frame tick (us)
+static int64_t _lasttime = 0;
+static int _verbose = 0;             // 1=hex dump every packet sent and received
+static const char *_metrics = NULL;  // prometheus text file rewritten every _metricsint seconds (NULL=none)
+static int _metricsint = 10;
+static volatile sig_atomic_t _quit = 0; // set by SIGINT/SIGTERM while tracing (exit through the normal path)
+
+// trace capture (records copied into a preallocated ring, written to file by a flush thread)
+static struct trace {
+  const char *path;  // trace file (NULL=off)
+  int fd;
+  uint8_t *buf;      // TRACE_RING bytes
+  uint32_t head;     // bytes added (event loop)
+  uint32_t tail;     // bytes written (flush thread)
+  int stop;
+  int64_t start;     // capture start (us)
+  int64_t records, dropped;
+  pthread_t thread;
+} _tr;
+
+// replay of a trace against stand-in devices (recorded responses returned for matching sends)
+static struct replay {
+  const char *path;  // trace file (NULL=off)
+  float speed;       // recorded delays divided by speed (0=no delays)
+  uint8_t *buf;      // whole trace
+  int64_t start;     // replay start (us)
+  int64_t last;      // last progress (us)
+  int64_t span;      // recorded duration (us)
+  int nreq, req;     // recorded requests, next to issue
+  struct trace_rec **rq;
+  struct device *trdev[256]; // device by recorded index
+  struct rpdev {
+    struct device *dev;
+    struct trace_rec **rec; // device records in order
+    int n, cur;      // records, next record not yet sent or matched
+    int pend;        // next recorded response to return (-1=waiting for a send)
+    int peer;        // stand-in end of connection (-1=none)
+    int64_t base, tbase; // replay and recorded time of the send answered (us)
+    int64_t sends, matched, skipped, unmatched;
+  } d[MAX_DEVICE];
+  int ndev;
+} _rp;
+
+// epoll tags (type|index)
+#define EV_DEV    0x10000
+#define EV_CLIENT 0x20000
+#define EV_LISTEN 0x30000
+#define EV_TTY    0x40000
+#define EV_ANIM   0x50000
+#define EV_AUDIO  0x60000
+#define EV_VIDEO  0x70000
+#define EV_RING   0x80000
+#define EV_REPLAY 0x90000
+
+// monotonic time in us
+int64_t now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000LL+ts.tv_nsec/1000;
+}
+
+// monotonic time in ms
+int64_t now_ms(void)
+{
+  return now_us()/1000;
+}
+
+// add latency sample to histogram
+void hist_add(struct hist *h, int64_t us)
+{
+  int i = (us <= 1) ? 0 : 64-__builtin_clzll(us-1);
+  METRIC_ADD(h->b[(i < HIST_BUCKETS) ? i : HIST_BUCKETS-1], 1);
+  METRIC_ADD(h->sum, (us > 0) ? us : 0);
+  METRIC_ADD(h->cnt, 1);
+}
+
+// write latency histogram for opcode (first METRIC_OPS-1 opcodes seen get their own)
+struct hist *metric_write(struct device *dev, int code)
+{
+  int i = 0;
+  while ((i < METRIC_OPS-1) && (dev->met.write[i].code != 0) && (dev->met.write[i].code != code))
+    ++i;
+  if ((i < METRIC_OPS-1) && (dev->met.write[i].code == 0))
+    dev->met.write[i].code = code;
+  return &dev->met.write[i].h;
+}
+
+// wall time in ms (cache timestamps outlive the process)
+int64_t wall_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec*1000LL+ts.tv_nsec/1000000;
+}
+
+// copy into trace ring (wraps at end)
+void trace_copy(uint32_t at, const void *data, int len)
+{
+  uint32_t off = at & (TRACE_RING-1), n = (len < TRACE_RING-off) ? len : TRACE_RING-off;
+  memcpy(_tr.buf+off, data, n);
+  memcpy(_tr.buf, (const uint8_t *)data+n, len-n);
+}
+
+// add trace record (dropped and counted if the flush thread is behind)
+void trace_put(struct device *dev, int type, const void *data, int len)
+{
+  if (_tr.buf == NULL)
+    return;
+  struct trace_rec rec = { now_us()-_tr.start, len, (dev != NULL) ? dev-_dev : 0xff, type };
+  uint32_t head = _tr.head;
+  if (sizeof(rec)+len > TRACE_RING-(head-__atomic_load_n(&_tr.tail, __ATOMIC_ACQUIRE))) {
+    ++_tr.dropped;
+    return;
+  }
+  trace_copy(head, &rec, sizeof(rec));
+  trace_copy(head+sizeof(rec), data, len);
+  ++_tr.records;
+  __atomic_store_n(&_tr.head, head+sizeof(rec)+len, __ATOMIC_RELEASE);
+}
+
+// flush thread (writes ring contents to file every TRACE_FLUSH ms until stopped and drained)
+void *trace_flush(void *arg)
+{
+  for (;;) {
+    int stop = __atomic_load_n(&_tr.stop, __ATOMIC_ACQUIRE);
+    uint32_t head = __atomic_load_n(&_tr.head, __ATOMIC_ACQUIRE), tail = _tr.tail;
+    while (tail != head) {
+      uint32_t off = tail & (TRACE_RING-1), n = (head-tail < TRACE_RING-off) ? head-tail : TRACE_RING-off;
+      ssize_t len = write(_tr.fd, _tr.buf+off, n);
+      if (len <= 0) {
+        fprintf(stderr, "%s: %s (%d)\n", _tr.path, strerror(errno), errno);
+        len = head-tail;
+      }
+      tail += len;
+      __atomic_store_n(&_tr.tail, tail, __ATOMIC_RELEASE);
+    }
+    if (stop)
+      return NULL;
+    struct timespec ts = { 0, TRACE_FLUSH*1000000L };
+    nanosleep(&ts, NULL);
+  }
+}
+
+// send packet to controller (traced)
+ssize_t dev_send(struct device *dev, const void *buf, size_t len)
+{
+  trace_put(dev, TR_SEND, buf, len);
+  return dev->tp->send(dev->sock, buf, len);
+}
+
+void trace_quit(int sig)
+{
+  _quit = 1;
+}
+
+// drain and close trace at exit
+void trace_close(void)
+{
+  __atomic_store_n(&_tr.stop, 1, __ATOMIC_RELEASE);
+  pthread_join(_tr.thread, NULL);
+  close(_tr.fd);
+  fprintf(stderr, "trace %s records=%lld dropped=%lld\n", _tr.path, (long long)_tr.records, (long long)_tr.dropped);
+}
+
+// start trace capture (file truncated)
+int trace_open(const char *path)
+{
+  struct trace_hdr hdr = { TRACE_MAGIC, 1, wall_ms() };
+  _tr.path = path;
+  if (((_tr.fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) || (write(_tr.fd, &hdr, sizeof(hdr)) != sizeof(hdr)) ||
+      ((_tr.buf = malloc(TRACE_RING)) == NULL)) {
+    fprintf(stderr, "%s: %s (%d)\n", path, strerror(errno), errno);
+    return -1;
+  }
+  _tr.start = now_us();
+  if ((errno = pthread_create(&_tr.thread, NULL, trace_flush, NULL)) != 0) {
+    fprintf(stderr, "trace thread: %s (%d)\n", strerror(errno), errno);
+    return -1;
+  }
+  atexit(trace_close);
+  signal(SIGINT, trace_quit);
+  signal(SIGTERM, trace_quit);
+  return 0;
+}
+
+// map per-address shadow cache (falls back to memory if file unusable)
+struct shadow *shadow_open(const char *addr)
+{
+  char path[256];
+  struct shadow *sh = MAP_FAILED;
+  if (_cache != NULL) {
+    int len = snprintf(path, sizeof(path), "%s/spe6-", _cache);
+    for (const char *c = addr; (*c != 0) && (len < sizeof(path)-7); ++c)
+      path[len++] = ((*c == '/') || (*c == ':')) ? '_' : *c;
+    strcpy(path+len, ".cache");
+    // owner only: the cache is trusted as controller state, so a file planted by another user is not used
+    struct stat st;
+    int fd = open(path, O_RDWR|O_CREAT|O_NOFOLLOW, 0600);
+    if ((fd >= 0) && (fstat(fd, &st) == 0) && (!S_ISREG(st.st_mode) || (st.st_uid != geteuid())))
+      errno = EPERM;
+    else if ((fd >= 0) && (fchmod(fd, 0600) == 0) && (ftruncate(fd, sizeof(*sh)) == 0))
+      sh = mmap(NULL, sizeof(*sh), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (sh == MAP_FAILED)
+      fprintf(stderr, "%s: %s (%d), cache kept in memory\n", path, strerror(errno), errno);
+    if (fd >= 0)
+      close(fd);
+  }
+  if ((sh == MAP_FAILED) && ((sh = calloc(1, sizeof(*sh))) == NULL))
+    exit(EXIT_FAILURE);
+  if ((sh->magic != SHADOW_MAGIC) || (sh->size != sizeof(*sh))) {
+    memset(sh, 0, sizeof(*sh));
+    sh->magic = SHADOW_MAGIC;
+    sh->size = sizeof(*sh);
+  }
+  if ((sh->ident < 0) || (sh->ident > sizeof(_ident)/sizeof(_ident[0])))
+    sh->ident = 0;
+  return sh;
+}
+
+// cached parms recent enough to stand in for a query
+int shadow_fresh(struct device *dev)
+{
+  return (dev->sh->queried > 0) && (wall_ms()-dev->sh->queried < _stale*1000LL);
+}
+
+// learned command rate (commands/s)
+float dev_rate(struct device *dev)
+{
+  return (dev->sh->rate > 0) ? dev->sh->rate : RATE_INIT;
+}
+
+// writes per confirmed batch (learned window up to --pipeline)
+int dev_window(struct device *dev)
+{
+  int window = dev->sh->cwnd;
+  return (window < 1) ? 1 : (window > _window) ? _window : window;
+}
+
+// show parms (with changes from previous) and config commands
+void show(FILE *fp, const struct sp630e *sp, const struct sp630e *pr)
+{
+  char out[4096];
+  int len = 0;
+  char prs[16], sps[16];
+  for (int i = 0; format[i].fmt != NULL; ++i) {
+    if (format[i].len == 0) {
+      len += snprintf(out+len, sizeof(out)-len, "%s", format[i].fmt);
+      continue;
+    }
+    // field bytes (separator rows have no offset)
+    const uint8_t *pr8 = (const uint8_t *)pr+format[i].off;
+    const uint8_t *sp8 = (const uint8_t *)sp+format[i].off;
+    if (strchr(format[i].fmt, 's') != NULL) {
+      snprintf(prs, sizeof(prs), format[i].fmt, pr8);
+      snprintf(sps, sizeof(sps), format[i].fmt, sp8);
+    } else {
+      snprintf(prs, sizeof(prs), format[i].fmt, pr8[0], pr8[1], pr8[2], pr8[3]);
+      snprintf(sps, sizeof(sps), format[i].fmt, sp8[0], sp8[1], sp8[2], sp8[3]);
+    }
+    if (strcmp(prs, sps) != 0)
+      len += snprintf(out+len, sizeof(out)-len, "%s=%s->%s ", format[i].key, prs, sps);
+    else
+      len += snprintf(out+len, sizeof(out)-len, "%s=%s ", format[i].key, sps);
+  }
+  if (len > 0)
+    fprintf(fp, "%s\n", out);
+
+  // show config commands with parameters (for copy/paste to other controllers)
+  fprintf(fp, "---\n");
+  fprintf(fp, "order %d\n", sp->order);
+  fprintf(fp, "onoff %d %d %d:%d\n", sp->oo_effect, sp->oo_speed, sp->oo_len[0], sp->oo_len[1]);
+  fprintf(fp, "bulk %d:%d %d %d %d %d %d:%d %d:%d:%d %d:%d\n", sp->mode, sp->effect, sp->level, sp->speed,
+      sp->len, sp->dir, sp->var44, sp->var45, sp->m_rgb[0], sp->m_rgb[1], sp->m_rgb[2], sp->var34, sp->var35);
+  fprintf(fp, "custom");
+  for (int i = 0; (i < sizeof(sp->cust)/sizeof(sp->cust[0])) && (sp->cust[i].len > 0); ++i)
+    fprintf(fp, " %d:%d:%d:%d", sp->cust[i].len, sp->cust[i].rgb[0], sp->cust[i].rgb[1], sp->cust[i].rgb[2]);
+  fprintf(fp, "\n");
+  fprintf(fp, "remote");
+  for (int i = 0; i < sp->rcnt; ++i)
+    fprintf(fp, " %d:%d", sp->rme[i*2+0], sp->rme[i*2+1]);
+  fprintf(fp, "\n");
+}
+
+// widest query notification expected to arrive intact
+// (limited by negotiated mtu, halving the gap to the known-good width after each failure)
+int dev_width(struct device *dev)
+{
+  int safe = (dev->wok > dev->safe) ? dev->wok : dev->safe;
+  int width = (dev->mtu < 9+sizeof(dev->sp)) ? dev->mtu : 9+sizeof(dev->sp);
+  if ((dev->wbad > 0) && (width >= dev->wbad))
+    width = (safe+dev->wbad)/2;
+  return (width > safe) ? width : safe;
+}
+
+// parse command (cmdline format: cmd <arg1> <arg2> ... <argn>) into gatt request
+// returns request length (0=nothing to send, -1=invalid command)
+int cmdline(struct device *dev, char *line, uint8_t *req, FILE *fp)
 {
-  // shortcut
-  if (line[0] == '?')
-    strcpy(line, "query 29");
+  // shortcut (and query without width) use widest width known to work
+  if ((line[0] == '?') || (strcmp(line, "query") == 0))
+    sprintf(line, "query %d", dev_width(dev));
+
+  // cached state (stale cache needs a query)
+  if ((strncmp(line, "state", 5) == 0) && ((unsigned char)line[5] <= ' ')) {
+    if (!shadow_fresh(dev)) {
+      sprintf(line, "query %d", dev_width(dev));
+    } else {
+      fprintf(fp, "cached %ds ago rate=%.1f/s window=%d\n", (int)((wall_ms()-dev->sh->queried)/1000), dev_rate(dev), dev_window(dev));
+      show(fp, &dev->sh->sp, &dev->sh->sp);
+      return 0;
+    }
+  }
 
   // parse input into whitespace separated values
   int ac = 0;
@@ -255,14 +722,25 @@ void cmdline(char *line, int sock)
   for (av[ac++] = strtok_r(line, "\n\"\'= ", &tok); av[ac] = strtok_r(NULL, "\n\"\': ", &tok); ++ac)
     if (ac+1 >= sizeof(av)/sizeof(av[0])) break;
   av[ac] = NULL;
+  if (av[0] == NULL)
+    return -1;
 
   // handle help special
   if (strcmp(av[0], "help") == 0) {
-    printf("parameters can be decimal or 0x-prefixed hexidecimal\n");
-    printf("#<request> <parm1> [<parm2> ...] (send a raw request)\n");
+    fprintf(fp, "parameters can be decimal or 0x-prefixed hexidecimal\n");
+    fprintf(fp, "#<request> <parm1> [<parm2> ...] (send a raw request)\n");
+    fprintf(fp, "state (cached parms unless older than --stale, otherwise query)\n");
+    fprintf(fp, "want <key=value> ... (send only what differs, keys as shown by query)\n");
+    fprintf(fp, "anim <fade|breathe|cycle> <ms> <rr:gg:bb> ... (host-rendered animation at --fps)\n");
+    fprintf(fp, "anim [stop] (show animation stats and optionally stop)\n");
+    fprintf(fp, "scene <bt-addr>,<bt-addr>... <cmd> <parm1> ... (apply to every controller together and report skew)\n");
+    fprintf(fp, "[prio=interactive|normal|background] [deadline=<ms>] <cmd> ... (queue class and drop if not sent in time)\n");
+    fprintf(fp, "queue (show queue depth and wait per priority class)\n");
+    fprintf(fp, "metrics (show link metrics in prometheus text format)\n");
+    fprintf(fp, "verbose [0|1] (hex dump every packet sent and received)\n");
     for (int i = 0; cmdlist[i].cmd[0] != 0; ++i)
-      printf("%s %s (%s)\n", cmdlist[i].cmd, cmdlist[i].parm, cmdlist[i].help);
-    return;
+      fprintf(fp, "%s %s (%s)\n", cmdlist[i].cmd, cmdlist[i].parm, cmdlist[i].help);
+    return 0;
   }
 
   // find matching request (name + number-of-args)
@@ -275,16 +753,10 @@ void cmdline(char *line, int sock)
     }
   }
   if (cmd == NULL)
-    return;
-
-  // enable notify prior to first query
-  if ((strcmp(av[0], "query") == 0) && (_sp.fw[0] == 0)) {
-    uint8_t req[] = { GATT_WRITE_REQ, 0x0f, 0x00, 0x01, 0x00 };
-    int rc = send(sock, req, sizeof(req), 0);
-    usleep(100*1000);
-  }
+    return -1;
 
-  uint8_t req[48] = { GATT_WRITE_REQ, 0x0e, 0x00, 0x53, cmd->code, 0x00, 0x01, 0x00, 0 };
+  const uint8_t hdr[] = { GATT_WRITE_REQ, 0x0e, 0x00, 0x53, cmd->code, 0x00, 0x01, 0x00, 0 };
+  memcpy(req, hdr, sizeof(hdr));
   uint8_t *add = req+8;
   char *adj = (char *)cmd->adj;
   // allow add-in byte(s)
@@ -296,262 +768,3273 @@ void cmdline(char *line, int sock)
   while ((*adj == 'p') && (*add < cmd->max))
     add[++(*add)] = strtol(adj+1, NULL, 0);
 
-  // check existing level prior to inc/dec
-  if ((strcmp(av[0], "inc") == 0) && (_sp.fw[0] != 0) && (_sp.level > add[2]))
-    return;
-  if ((strcmp(av[0], "dec") == 0) && (_sp.fw[0] != 0) && (_sp.level < add[2]))
-    return;
+  return (add-req)+1+add[0];
+}
+
+// change connection state (timeout in ms, -1=none)
+void dev_state(struct device *dev, int state, int64_t timeout)
+{
+  if (dev->state != state)
+    dev->retry = 0;
+  dev->state = state;
+  dev->timer = (timeout >= 0) ? now_ms()+timeout : INT64_MAX;
+}
+
+// parked device (disconnected until next request)
+int dev_parked(struct device *dev)
+{
+  return (dev->state == DEV_DOWN) && (dev->timer == INT64_MAX);
+}
 
-  int len = (add-req)+1+add[0];
-  int rc = send(sock, req, len, 0);
-  fprintf(stderr, "send(%d): ", len);
-  for (int i = 0; i < len; ++i)
-    fprintf(stderr, "%02x ", req[i]);
-  fprintf(stderr, "(rc=%d)\n", rc);
-  if ((rc > 0) && (req[4] == 0x02)) {
-    _qs.off = -1;
+// ready for requests (idle timer runs liveness probe)
+void dev_ready(struct device *dev)
+{
+  if (dev->connstart > 0) {
+    METRIC_ADD(dev->met.connects, 1);
+    hist_add(&dev->met.connect, now_us()-dev->connstart);
+    dev->connstart = 0;
   }
+  // link proved healthy once idle or a response completes (a link dropping mid-request keeps backing off)
+  if ((dev->rqhead == NULL) && (dev->busy == NULL))
+    dev->fails = 0;
+  dev_state(dev, DEV_READY, (_probe > 0) ? _probe*1000LL : -1);
 }
 
-// process incoming packet
-void receive(const uint8_t *rcvbuf, int rcvlen)
+// adapt rate and window to write response (err=NULL ok, otherwise timeout/error/disconnect)
+// aimd: healthy responses with requests held back add 1/s and grow the window by one per window of batches,
+// slow responses (over twice the fastest plus RATE_SLOW) back off to 3/4 rate and half window,
+// failures halve the rate and confirm every write
+void dev_pace(struct device *dev, const char *err)
 {
-  // parse device config (first segment determines width)
-  if ((rcvlen > 8) && (rcvbuf[0] == GATT_HAND_VAL_NOTIFY) && (rcvbuf[3] == 0x53) && (rcvbuf[4] == 0x02)) {
-    static int wid = 0;
-    int seg = rcvbuf[7];
-    int len = rcvbuf[8];
-    if (seg == 0)
-      _qs.off = 0;
-    if (_qs.off+len <= sizeof(_sp))
-      memcpy(&_sp.u0+_qs.off, rcvbuf+9, len);
-    // must receive at least 77 bytes (rcnt)
-    if ((_qs.off += len) < 77)
-      return;
-    // use rcnt to calc actual length
-    if (_qs.off < 77+_sp.rcnt*2)
-      return;
-    _qs.off = 0;
+  struct shadow *sh = dev->sh;
+  float rate = dev_rate(dev), cwnd = (sh->cwnd >= 1) ? sh->cwnd : 1;
+  int slow = 0;
+  if ((err == NULL) && (dev->rtt > 0)) {
+    if ((dev->rttmin == 0) || (dev->rtt < dev->rttmin))
+      dev->rttmin = dev->rtt;
+    slow = dev->rtt > 2*dev->rttmin+RATE_SLOW*1000;
+  }
+  if ((err != NULL) || slow) {
+    rate *= (err != NULL) ? 0.5 : 0.75;
+    cwnd = (err != NULL) ? 1 : cwnd/2;
+    fprintf(stderr, "%s backoff %.1f/s window=%d (%s)\n", dev->addr, (rate < RATE_MIN) ? RATE_MIN : rate,
+        (cwnd < 1) ? 1 : (int)cwnd, (err != NULL) ? err : "slow response");
+  } else if (dev->limited) {
+    rate += 1;
+    if (cwnd < _window)
+      cwnd += 1/cwnd;
+  }
+  sh->rate = (rate < RATE_MIN) ? RATE_MIN : (rate > RATE_MAX) ? RATE_MAX : rate;
+  sh->cwnd = (cwnd < 1) ? 1 : cwnd;
+  dev->limited = 0;
+}
 
-    // show parms/changes after final query segment
-    char out[4096];
-    if (!_qs.cnt++)
-      memcpy(&_pr, &_sp, sizeof(_pr));
+// scene member for device (NULL=not in scene)
+struct scene_dev *scene_member(struct scene *sc, struct device *dev)
+{
+  for (int i = 0; i < sc->n; ++i)
+    if (sc->m[i].dev == dev)
+      return &sc->m[i];
+  return NULL;
+}
 
-    const char *key[256] = { NULL } ;
-    for (int i = 0; format[i].fmt != NULL; ++i) {
-      uint8_t *pr8 = format[i].pr;
-      uint8_t *sp8 = format[i].sp;
-      if ((pr8 == NULL) || (sp8 == NULL))
-        continue;
-      for (int j = 0; j < format[i].len; ++j) {
-        key[sp8-_sp.u0+j] = format[i].key;
+// report scene once every write has responded (skew is the spread of estimated arrival, send+rtt/2)
+void scene_report(struct scene *sc)
+{
+  FILE *fp = (sc->cl != NULL) ? sc->cl->fp : stdout;
+  int64_t first = INT64_MAX, range[3][2] = { { INT64_MAX, 0 }, { INT64_MAX, 0 }, { INT64_MAX, 0 } };
+  for (int i = 0; i < sc->n; ++i)
+    if (sc->m[i].sent > 0)
+      first = (sc->m[i].sent < first) ? sc->m[i].sent : first;
+  for (int i = 0; i < sc->n; ++i) {
+    if (sc->m[i].sent == 0)
+      continue;
+    int64_t t[3] = { sc->m[i].sent+sc->m[i].rtt/2, sc->m[i].sent, sc->m[i].acked };
+    for (int j = 0; j < 3; ++j)
+      if (t[j] > 0) {
+        range[j][0] = (t[j] < range[j][0]) ? t[j] : range[j][0];
+        range[j][1] = (t[j] > range[j][1]) ? t[j] : range[j][1];
       }
-    }
+    fprintf(fp, "scene %s sent=+%lldus rtt=%lldus ack=+%lldus\n", sc->m[i].dev->addr, (long long)(sc->m[i].sent-first),
+        (long long)sc->m[i].rtt, (long long)((sc->m[i].acked > 0) ? sc->m[i].acked-first : -1));
+  }
+  for (int j = 0; j < 3; ++j)
+    range[j][1] = (range[j][1] > range[j][0]) ? range[j][1]-range[j][0] : 0;
+  fprintf(fp, "scene %s devices=%d skew=%lldus send=%lldus ack=%lldus staged=%lldus\n", sc->name, sc->n, (long long)range[0][1],
+      (long long)range[1][1], (long long)range[2][1], (long long)((first < INT64_MAX) ? first-sc->start : 0));
+  if (sc->err[0] != 0)
+    fprintf(fp, "err scene %s: %s\n", sc->name, sc->err);
+  else
+    fprintf(fp, "ok scene %s\n", sc->name);
+  fflush(fp);
+  sc->n = 0;
+}
 
-    len = 0;
-    for (int i = 0; i < sizeof(_sp); ++i)
-      if (_pr.u0[i] != _sp.u0[i]) {
-        if (key[i] != NULL)
-          len += snprintf(out+len, sizeof(out)-len, "(%s)", key[i]);
-        len += snprintf(out+len, sizeof(out)-len, "0x%02x:%02x->%02x ", i, _pr.u0[i], _sp.u0[i]);
-      }
-    if (len > 0)
-      fprintf(stderr, "diff: %s\n", out);
+// ring status for response (NULL=ok)
+int ring_status(const char *err)
+{
+  static const struct {
+    const char *err;
+    int status;
+  } map[] = {
+    { "invalid command", SPE6_EINVAL },
+    { "queue full", SPE6_EFULL },
+    { "not connected", SPE6_ECONN },
+    { "disconnected", SPE6_ECONN },
+    { "timeout", SPE6_ETIMEOUT },
+    { "error response", SPE6_ERESP },
+    { "deadline", SPE6_EDEADLINE },
+  };
+  if (err == NULL)
+    return SPE6_OK;
+  for (int i = 0; i < sizeof(map)/sizeof(map[0]); ++i)
+    if (strcmp(err, map[i].err) == 0)
+      return map[i].status;
+  return SPE6_EFAIL;
+}
 
-    len = 0;
-    char pr[16], sp[16];
-    for (int i = 0; format[i].fmt != NULL; ++i) {
-      uint8_t *pr8 = format[i].pr;
-      uint8_t *sp8 = format[i].sp;
-      if ((pr8 == NULL) || (sp8 == NULL)) {
-        len += snprintf(out+len, sizeof(out)-len, "%s", format[i].fmt);
-        continue;
-      } else if (strchr(format[i].fmt, 's') != NULL) {
-        snprintf(pr, sizeof(pr), format[i].fmt, format[i].pr);
-        snprintf(sp, sizeof(sp), format[i].fmt, format[i].sp);
-      } else {
-        snprintf(pr, sizeof(pr), format[i].fmt, pr8[0], pr8[1], pr8[2], pr8[3]);
-        snprintf(sp, sizeof(sp), format[i].fmt, sp8[0], sp8[1], sp8[2], sp8[3]);
-      }
-      if (strcmp(pr, sp) != 0)
-        len += snprintf(out+len, sizeof(out)-len, "%s=%s->%s ", format[i].key, pr, sp);
-      else
-        len += snprintf(out+len, sizeof(out)-len, "%s=%s ", format[i].key, sp);
-    }
-    if (len > 0)
-      printf("%s\n", out);
-    memcpy(&_pr, &_sp, sizeof(_pr));
-
-    // show config commands with parameters (for copy/paste to other controllers)
-    printf("---\n");
-    printf("order %d\n", _sp.order);
-    printf("onoff %d %d %d:%d\n", _sp.oo_effect, _sp.oo_speed, _sp.oo_len[0], _sp.oo_len[1]);
-    printf("bulk %d:%d %d %d %d %d %d:%d %d:%d:%d %d:%d\n", _sp.mode, _sp.effect, _sp.level, _sp.speed,
-        _sp.len, _sp.dir, _sp.var44, _sp.var45, _sp.m_rgb[0], _sp.m_rgb[1], _sp.m_rgb[2], _sp.var34, _sp.var35);
-    printf("custom");
-    for (int i = 0; (i < sizeof(_sp.cust)/sizeof(_sp.cust[0])) && (_sp.cust[i].len > 0); ++i)
-      printf(" %d:%d:%d:%d", _sp.cust[i].len, _sp.cust[i].rgb[0], _sp.cust[i].rgb[1], _sp.cust[i].rgb[2]);
-    printf("\n");
-    printf("remote");
-    for (int i = 0; i < _sp.rcnt; ++i)
-      printf(" %d:%d", _sp.rme[i*2+0], _sp.rme[i*2+1]);
-    printf("\n");
+// complete request and report result to requester
+void respond(struct device *dev, struct request *rq, const char *err)
+{
+  // track accepted commands in shadow (query results replace it wholesale)
+  if ((err == NULL) && (rq->len > 9) && (rq->req[4] != 0x02) && (dev->sh->queried > 0)) {
+    sp630e_apply(&dev->sh->sp, rq->req[4], rq->req+9, (rq->req[8] < rq->len-9) ? rq->req[8] : rq->len-9);
+    dev->sh->updated = wall_ms();
   }
+  if (rq->sc != NULL) {
+    struct scene *sc = rq->sc;
+    if (scene_member(sc, dev) != NULL)
+      scene_member(sc, dev)->acked = (err == NULL) ? now_us() : 0;
+    if ((err != NULL) && (sc->err[0] == 0))
+      snprintf(sc->err, sizeof(sc->err), "%s %s", dev->addr, err);
+    if (--sc->left == 0)
+      scene_report(sc);
+  }
+  if (rq->slot != NULL)
+    __atomic_store_n(&rq->slot->status, ring_status(err), __ATOMIC_RELEASE);
+  // quiet requests (reconcile) only report failures, and only to stderr
+  if ((rq->cl != NULL) && !rq->quiet && (err != NULL))
+    fprintf(rq->cl->fp, "err %s %s: %s\n", dev->addr, rq->name, err);
+  else if ((rq->cl != NULL) && !rq->quiet)
+    fprintf(rq->cl->fp, "ok %s %s\n", dev->addr, rq->name);
+  else if (err != NULL)
+    fprintf(stderr, "%s %s: %s\n", dev->addr, rq->name, err);
+  if ((rq->cl != NULL) && !rq->quiet)
+    fflush(rq->cl->fp);
+  free(rq->plan);
+  free(rq);
 }
 
-int main(int argc, char *argv[])
+// complete in-flight batch (write commands ride on the confirmed write at its end)
+void complete(struct device *dev, const char *err)
 {
-  if (argc < 2) {
-    fprintf(stderr, "usage: %s bt-addr [timeout] [--cmd=\"parm(s)\"] [--cmd=\"parm(s)\"] ... [-I(nteractive)]\n", argv[0]);
-    for (int i = 0; cmdlist[i].cmd[0] != 0; ++i) {
-      char cmd[256];
-      snprintf(cmd, sizeof(cmd), "  --%s=\"%s\"", cmdlist[i].cmd, cmdlist[i].parm);
-      fprintf(stderr, "%-40s  %s\n", cmd, cmdlist[i].help);
-      //fprintf(stderr, "  --%s=\"%s\" (%s)\n", cmdlist[i].cmd, cmdlist[i].parm, cmdlist[i].help);
+  if ((dev->busy != NULL) && (err == NULL)) {
+    dev->fails = 0;
+    struct request *end = dev->busy;
+    while (end->next != NULL)
+      end = end->next;
+    dev->rtt = now_us()-dev->busy->sent;
+    if (dev->busy->req[4] == 0x02) {
+      METRIC_ADD(dev->met.queries, 1);
+      hist_add(&dev->met.query, dev->rtt);
+    } else {
+      dev_pace(dev, NULL);
+      hist_add(metric_write(dev, end->req[4]), dev->rtt);
     }
-    exit(0);
   }
+  // failure of the closing write leaves every write of the batch unconfirmed (reported and not shadowed)
+  for (struct request *rq = dev->busy, *next; rq != NULL; rq = next) {
+    next = rq->next;
+    respond(dev, rq, err);
+  }
+  dev->busy = NULL;
+  if (dev->state == DEV_BUSY)
+    dev_ready(dev);
+}
 
-  int argi = 2;
-  time_t lasttime = (argc >= 3) && (argv[2][0] >= '1') && (argv[2][0] <= '9') ? time(NULL)+atoi(argv[argi++]) : time(NULL)+60;
-  const char *kind = NULL;
-  for (int sock = -1, tty = 0; time(NULL) <= lasttime;) {
-    // handle socket init/connect
-    if (sock < 0) {
-      kind = NULL;
-      memset(&_sp, 0, sizeof(_sp));
-      memset(&_qs, 0, sizeof(_qs));
-      sock = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
-      if (sock < 0) {
-        fprintf(stderr, "socket error: %s (%d)\n", strerror(errno), errno);
-        usleep(1000*1000);
-        continue;
-      }
+// add request to device queue (after every request of the same or a higher class)
+void append(struct device *dev, struct request *rq)
+{
+  rq->queued = now_us();
+  struct request **pp = &dev->rqhead;
+  if ((dev->rqtail != NULL) && (dev->rqtail->prio <= rq->prio))
+    pp = &dev->rqtail->next;
+  while ((*pp != NULL) && ((*pp)->prio <= rq->prio))
+    pp = &(*pp)->next;
+  rq->next = *pp;
+  *pp = rq;
+  if (rq->next == NULL)
+    dev->rqtail = rq;
+}
 
-      // bluetooth requires binding prior to connect
-      struct sockaddr_l2 addr;
-      memset(&addr, 0, sizeof(addr));
-      addr.l2_family = AF_BLUETOOTH;
-      addr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
-      addr.l2_cid = htobs(4);
-      if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
-        fprintf(stderr, "bind error: %s (%d)\n", strerror(errno), errno);
-
-      // connect at low security
-      struct bt_security sec;
-      memset(&sec, 0, sizeof(sec));
-      sec.level = BT_SECURITY_LOW;
-      if (setsockopt(sock, SOL_BLUETOOTH, BT_SECURITY, &sec, sizeof(sec)) < 0)
-        fprintf(stderr, "setsockopt error: %s (%d)\n", strerror(errno), errno);
-
-      // setup destination bluetooth address
-      memset(&addr, 0, sizeof(addr));
-      addr.l2_family = AF_BLUETOOTH;
-      addr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
-      addr.l2_cid = htobs(4);
-      str2ba(argv[1], &addr.l2_bdaddr);
-
-      // non-blocking connect+poll to control timeout
-      int block = fcntl(sock, F_GETFL, 0);
-      fcntl(sock, F_SETFL, block|O_NONBLOCK);
-      connect(sock, (struct sockaddr *)&addr, sizeof(addr));
-      struct pollfd pfd = { .fd = sock, .events = POLLOUT, .revents = 0 };
-      time_t conntime = lasttime-time(NULL);
-      if (conntime > CONN_TIMEOUT)
-        conntime = CONN_TIMEOUT;
-      fprintf(stderr, "connect %s (timeout=%d)\n", argv[1], conntime);
-      poll(&pfd, 1, conntime*1000);
-      if (pfd.revents != POLLOUT)
-        fprintf(stderr, "connect error: revents=%02x\n", pfd.revents);
-      fcntl(sock, F_SETFL, block);
-    }
-
-    // wait for packet (or console input during interactive mode)
-    struct pollfd pfd[2] = { {.fd=sock, .events=POLLIN, .revents=0 }, {.fd=0, .events=POLLIN, .revents=0} };
-    if (poll(pfd, 1+tty, 250) < 0) {
-       fprintf(stderr, "poll error: %s (%d)\n", strerror(errno), errno);
-       continue;
-    }
-
-    // if poll timed out and unidentified device, query it
-    // (can happen multiple times as sp630e goes unresponsive periodically)
-    if (!pfd[0].revents && !tty && (kind == NULL)) {
-      fprintf(stderr, "identify 0x2902\n");
-      usleep(100*1000);
-      uint8_t req[] = { GATT_READ_BY_TYPE_REQ, 0x01, 0x00, 0xff, 0xff, 0x02, 0x29 };
-      if (send(sock, req, sizeof(req), 0) < 0) {
-        fprintf(stderr, "identify error: %s (%d)\n", strerror(errno), errno);
-        close(sock);
-        sock = -1;
-        continue;
-      }
-    }
+// prometheus histogram (buckets cumulative, in seconds)
+void metrics_hist(FILE *fp, const char *name, const char *label, const struct hist *h)
+{
+  uint64_t cum = 0;
+  for (int i = 0; i < HIST_BUCKETS; ++i) {
+    cum += h->b[i];
+    if (i < HIST_BUCKETS-1)
+      fprintf(fp, "%s_bucket{%s,le=\"%g\"} %llu\n", name, label, (1 << i)/1e6, (unsigned long long)cum);
+  }
+  fprintf(fp, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, label, (unsigned long long)h->cnt);
+  fprintf(fp, "%s_sum{%s} %g\n", name, label, h->sum/1e6);
+  fprintf(fp, "%s_count{%s} %llu\n", name, label, (unsigned long long)h->cnt);
+}
 
-    // process any incoming packet
-    if (pfd[0].revents) {
-      uint8_t rcvbuf[1024];
-      int rcvlen = read(sock, rcvbuf, sizeof(rcvbuf));
-      if (rcvlen < 0) {
-        fprintf(stderr, "read error: %s (%d)\n", strerror(errno), errno);
-        close(sock);
-        sock = -1;
-        continue;
+// show metrics in prometheus text format (every device or only one)
+void metrics_show(FILE *fp, struct device *only)
+{
+  static const struct {
+    const char *name, *help;
+    size_t off;
+  } counter[] = {
+    { "spe6_connects_total", "Connects that reached ready", offsetof(struct metrics, connects) },
+    { "spe6_connect_failures_total", "Connect attempts that failed before ready", offsetof(struct metrics, connfail) },
+    { "spe6_disconnects_total", "Established connections dropped", offsetof(struct metrics, disconnects) },
+    { "spe6_identify_retries_total", "Identify requests resent after no response", offsetof(struct metrics, identretry) },
+    { "spe6_timeouts_total", "Requests without response", offsetof(struct metrics, timeouts) },
+    { "spe6_error_responses_total", "Requests answered with an error response", offsetof(struct metrics, errors) },
+    { "spe6_queries_total", "Parm queries completed", offsetof(struct metrics, queries) },
+    { "spe6_query_notifications_total", "Query notifications received", offsetof(struct metrics, notifies) },
+  };
+  char label[sizeof(_dev[0].addr)+32]; // addr and opcode labels
+#define EACH(dev) for (struct device *dev = _dev; dev < _dev+_ndev; ++dev) if ((only == NULL) || (only == dev))
+  fprintf(fp, "# HELP spe6_up Controller connected and identified\n# TYPE spe6_up gauge\n");
+  EACH(dev)
+    fprintf(fp, "spe6_up{addr=\"%s\"} %d\n", dev->addr, dev->state >= DEV_READY);
+  for (int i = 0; i < sizeof(counter)/sizeof(counter[0]); ++i) {
+    fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n", counter[i].name, counter[i].help, counter[i].name);
+    EACH(dev)
+      fprintf(fp, "%s{addr=\"%s\"} %llu\n", counter[i].name, dev->addr, *(unsigned long long *)((char *)&dev->met+counter[i].off));
+  }
+  fprintf(fp, "# HELP spe6_connect_seconds Connect start to ready\n# TYPE spe6_connect_seconds histogram\n");
+  EACH(dev) {
+    snprintf(label, sizeof(label), "addr=\"%.*s\"", (int)sizeof(dev->addr), dev->addr);
+    metrics_hist(fp, "spe6_connect_seconds", label, &dev->met.connect);
+  }
+  fprintf(fp, "# HELP spe6_query_seconds Parm query send to reassembled\n# TYPE spe6_query_seconds histogram\n");
+  EACH(dev) {
+    snprintf(label, sizeof(label), "addr=\"%.*s\"", (int)sizeof(dev->addr), dev->addr);
+    metrics_hist(fp, "spe6_query_seconds", label, &dev->met.query);
+  }
+  fprintf(fp, "# HELP spe6_write_seconds Write to response by opcode of the confirmed write\n# TYPE spe6_write_seconds histogram\n");
+  EACH(dev)
+    for (int i = 0; i < METRIC_OPS; ++i)
+      if (dev->met.write[i].h.cnt > 0) {
+        snprintf(label, sizeof(label), (i < METRIC_OPS-1) ? "addr=\"%.*s\",opcode=\"0x%02x\"" : "addr=\"%.*s\",opcode=\"other\"",
+            (int)sizeof(dev->addr), dev->addr, dev->met.write[i].code);
+        metrics_hist(fp, "spe6_write_seconds", label, &dev->met.write[i].h);
       }
+  fprintf(fp, "# HELP spe6_queue_depth Requests queued\n# TYPE spe6_queue_depth gauge\n");
+  EACH(dev) {
+    int depth[PRIO_MAX] = { 0 };
+    for (struct request *q = dev->rqhead; q != NULL; q = q->next)
+      ++depth[q->prio];
+    for (int i = 0; i < PRIO_MAX; ++i)
+      fprintf(fp, "spe6_queue_depth{addr=\"%s\",class=\"%s\"} %d\n", dev->addr, _prio[i], depth[i]);
+  }
+  fprintf(fp, "# HELP spe6_queue_sent_total Requests sent\n# TYPE spe6_queue_sent_total counter\n");
+  EACH(dev)
+    for (int i = 0; i < PRIO_MAX; ++i)
+      fprintf(fp, "spe6_queue_sent_total{addr=\"%s\",class=\"%s\"} %lld\n", dev->addr, _prio[i], (long long)dev->pq[i].sent);
+  fprintf(fp, "# HELP spe6_queue_expired_total Requests dropped at their deadline\n# TYPE spe6_queue_expired_total counter\n");
+  EACH(dev)
+    for (int i = 0; i < PRIO_MAX; ++i)
+      fprintf(fp, "spe6_queue_expired_total{addr=\"%s\",class=\"%s\"} %lld\n", dev->addr, _prio[i], (long long)dev->pq[i].expired);
+  fprintf(fp, "# HELP spe6_queue_wait_seconds_total Queued to sent wait of sent requests\n# TYPE spe6_queue_wait_seconds_total counter\n");
+  EACH(dev)
+    for (int i = 0; i < PRIO_MAX; ++i)
+      fprintf(fp, "spe6_queue_wait_seconds_total{addr=\"%s\",class=\"%s\"} %g\n", dev->addr, _prio[i], dev->pq[i].wsum/1e6);
+  fprintf(fp, "# HELP spe6_rate_commands Learned command rate per second\n# TYPE spe6_rate_commands gauge\n");
+  EACH(dev)
+    fprintf(fp, "spe6_rate_commands{addr=\"%s\"} %.1f\n", dev->addr, dev_rate(dev));
+#undef EACH
+}
 
-      // show meaningful packets (skip single byte response acknowledgements)
-      if ((rcvlen > 1) || (rcvbuf[0] != GATT_WRITE_RSP)) {
-        fprintf(stderr, "recv(%d):", rcvlen);
-        for (int i = 0; i < rcvlen; ++i)
-          fprintf(stderr, " %02x", rcvbuf[i]);
-        if ((rcvbuf[rcvlen-1] > ' ') && (rcvbuf[rcvlen-1] < 127))
-          fprintf(stderr, " (%c)", rcvbuf[rcvlen-1]);
-        fprintf(stderr, "\n");
-      }
+// rewrite metrics file (renamed into place so readers never see a partial file)
+void metrics_file(void)
+{
+  char tmp[300];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", _metrics);
+  FILE *fp = fopen(tmp, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "metrics %s: %s (%d)\n", tmp, strerror(errno), errno);
+    return;
+  }
+  metrics_show(fp, NULL);
+  if ((fclose(fp) != 0) || (rename(tmp, _metrics) < 0))
+    fprintf(stderr, "metrics %s: %s (%d)\n", _metrics, strerror(errno), errno);
+}
 
-      // handle identify response
-      if ((rcvlen > 4) && (rcvbuf[0] == GATT_READ_BY_TYPE_RSP)) {
-        for (int i = 0; i < sizeof(_ident)/sizeof(_ident[0]); ++i) {
-          const uint8_t *resp = _ident[i].resp;
-          if ((rcvlen == resp[0]+4) && (memcmp(rcvbuf+4, resp+1, resp[0]) == 0)) {
-            kind = _ident[i].kind;
-            fprintf(stderr, "found %s\n", kind);
-            break;
-          }
-        }
-      }
+// show queue depth and wait per priority class
+void queue_stats(struct device *dev, FILE *fp)
+{
+  int depth[PRIO_MAX] = { 0 };
+  for (struct request *q = dev->rqhead; q != NULL; q = q->next)
+    ++depth[q->prio];
+  for (int i = 0; i < PRIO_MAX; ++i)
+    fprintf(fp, "queue %s %s depth=%d sent=%lld expired=%lld wait=%lld/%lldus\n", dev->addr, _prio[i], depth[i],
+        (long long)dev->pq[i].sent, (long long)dev->pq[i].expired,
+        (long long)(dev->pq[i].sent ? dev->pq[i].wsum/dev->pq[i].sent : 0), (long long)dev->pq[i].wmax);
+}
 
-      // handle other receive
-      receive(rcvbuf, rcvlen);
+// drop queued write superseded by rq (same setting, so only newest value matters)
+// returns queue length remaining
+int supersede(struct device *dev, struct request *rq)
+{
+  // settings that are idempotent overwrites (pulse, remote, custom etc. keep their order)
+  static const uint8_t lww[] = { 0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x5e, 0x60, 0x61, 0x6b, 0x6c };
+  int idem = (rq->len > 9) && !rq->cond && (memchr(lww, rq->req[4], sizeof(lww)) != NULL);
+  int len = 0;
+  for (struct request **pp = &dev->rqhead, *q; (q = *pp) != NULL; ) {
+    // same opcode and parm count (level also same color/white target), only by a request at least as
+    // urgent that cannot expire before the one it replaces
+    if (idem && !q->cond && !q->quiet && (q->plan == NULL) && (q->req[4] == rq->req[4]) && (q->req[8] == rq->req[8]) &&
+        ((q->req[4] != 0x51) || (q->req[9] == rq->req[9])) && (rq->prio <= q->prio) &&
+        ((rq->deadline == 0) || ((q->deadline > 0) && (rq->deadline >= q->deadline)))) {
+      *pp = q->next;
+      q->len = 0;
+      respond(dev, q, NULL);
+      continue;
     }
+    pp = &q->next;
+    dev->rqtail = q;
+    ++len;
+  }
+  if (dev->rqhead == NULL)
+    dev->rqtail = NULL;
+  return len;
+}
 
-    // process interactive console
-    if (pfd[1].revents) {
-      char line[256];
-      fgets(line, sizeof(line), stdin);
-      if (line[0] >= ' ')
-        cmdline(line, sock);
+// queue quiet parm query unless one at the same or a higher class is already queued or in flight
+void query_queue(struct device *dev, int prio)
+{
+  int queued = (dev->busy != NULL) && (dev->busy->req[4] == 0x02);
+  for (struct request *q = dev->rqhead; q != NULL; q = q->next)
+    queued |= (q->req[4] == 0x02) && (q->prio <= prio);
+  if (queued)
+    return;
+  char buf[16] = "query";
+  struct request *qr = calloc(1, sizeof(*qr));
+  strcpy(qr->name, "query");
+  qr->prio = prio;
+  qr->quiet = 1;
+  qr->len = cmdline(dev, buf, qr->req, stdout);
+  append(dev, qr);
+}
+
+// show animation stats
+void anim_stats(struct device *dev, FILE *fp)
+{
+  struct anim *an = &dev->an;
+  int64_t elapsed = now_us()-an->start;
+  fprintf(fp, "anim %s %s fps=%.1f frames=%lld dropped=%lld jitter=%lld/%lldus\n", dev->addr, _animkind[an->kind],
+      (elapsed > 0) ? an->frames*1e6/elapsed : 0.0, (long long)an->frames, (long long)an->dropped,
+      (long long)(an->ticks ? an->jsum/an->ticks : 0), (long long)an->jmax);
+}
+
+// (re)start frame timer (runs while any device animates)
+void anim_timer(void)
+{
+  if (_animfd < 0) {
+    _animfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EV_ANIM };
+    epoll_ctl(_epfd, EPOLL_CTL_ADD, _animfd, &ev);
+  }
+  long period = 1000000000L/_fps;
+  struct itimerspec its = { { 0, period }, { 0, period } };
+  if (period >= 1000000000L)
+    its.it_interval = its.it_value = (struct timespec) { 1, 0 };
+  timerfd_settime(_animfd, 0, &its, NULL);
+  _animtick = 0;
+}
+
+// start animation (anim <fade|breathe|cycle> <ms> <rr:gg:bb> [...], anim stop, anim alone shows stats)
+// returns 1 if started (-1=invalid)
+int anim(struct device *dev, char *line, FILE *fp)
+{
+  int ac = 0;
+  char *av[12], *tok = NULL;
+  for (char *a = strtok_r(line, " ,=\t\n\"\'", &tok); (a != NULL) && (ac < 12); a = strtok_r(NULL, " ,=\t\n\"\'", &tok))
+    av[ac++] = a;
+  struct anim *an = &dev->an, next = { 0 };
+  if ((ac == 1) || ((ac == 2) && (strcmp(av[1], "stop") == 0))) {
+    if (an->start > 0)
+      anim_stats(dev, fp);
+    if (ac == 2)
+      an->kind = ANIM_NONE;
+    return 0;
+  }
+  for (int i = 1; i < sizeof(_animkind)/sizeof(_animkind[0]); ++i)
+    if (strcmp(av[1], _animkind[i]) == 0)
+      next.kind = i;
+  if ((next.kind == ANIM_NONE) || (ac < 4) || ((next.step = atoi(av[2])*1000LL) <= 0))
+    return -1;
+  // fade starts from current color
+  if (next.kind == ANIM_FADE)
+    memcpy(next.color[next.ncolor++], dev->sh->sp.rgb, 3);
+  for (int i = 3; (i < ac) && (next.ncolor < sizeof(next.color)/sizeof(next.color[0])); ++i) {
+    unsigned r, g, b;
+    if (sscanf(av[i], "%02x:%02x:%02x", &r, &g, &b) != 3)
+      return -1;
+    next.color[next.ncolor][0] = r;
+    next.color[next.ncolor][1] = g;
+    next.color[next.ncolor++][2] = b;
+  }
+  // (queried first when the cache is stale, once the palette is known to be valid)
+  if ((next.kind == ANIM_FADE) && (next.wait = !shadow_fresh(dev)))
+    query_queue(dev, PRIO_INTERACTIVE);
+  next.start = now_us();
+  *an = next;
+
+  anim_timer();
+  return 1;
+}
+
+// parse want key=value list (keys and value formats as shown by query)
+// returns number of keys (-1=unknown key or malformed value)
+int want(struct plan *pl, char *line, FILE *fp)
+{
+  int cnt = 0;
+  char *tok = NULL;
+  for (char *kv = strtok_r(line, " ,\t\n\"\'", &tok); kv != NULL; kv = strtok_r(NULL, " ,\t\n\"\'", &tok), ++cnt) {
+    char *val = strchr(kv, '=');
+    int i = 0;
+    if (val != NULL)
+      *val++ = 0;
+    while ((format[i].fmt != NULL) && ((format[i].key == NULL) || (strcmp(format[i].key, kv) != 0)))
+      ++i;
+    if ((val == NULL) || (format[i].fmt == NULL) || (strchr(format[i].fmt, 's') != NULL)) {
+      fprintf(fp, "want: unknown key %s\n", kv);
+      return -1;
+    }
+    // scan with the display format (as unsigned)
+    char fmt[32];
+    unsigned v[4];
+    int n = 0;
+    snprintf(fmt, sizeof(fmt), "%s", format[i].fmt);
+    for (char *c = fmt; (c = strchr(c, '%')) != NULL; ++n) {
+      c += 1+strspn(c+1, "0123456789");
+      if (*c == 'd')
+        *c = 'u';
     }
+    if ((n != format[i].len) || (sscanf(val, fmt, &v[0], &v[1], &v[2], &v[3]) != n)) {
+      fprintf(fp, "want: malformed %s=%s (%s)\n", kv, val, format[i].fmt);
+      return -1;
+    }
+    for (int j = 0; j < n; ++j) {
+      ((uint8_t *)&pl->sp)[format[i].off+j] = v[j];
+      pl->set[format[i].off+j] = 1;
+    }
+  }
+  return cnt;
+}
 
-    // process command-line parms
-    if ((kind != NULL) && (_qs.off == 0) && (argi < argc)) {
-      char line[4096];
-      snprintf(line, sizeof(line), "%s", argv[argi++]);
-      if ((line[0] == '-') && (line[1] == '-')) {
-        cmdline(line+2, sock);
-        // next cycle waits for the response
+// parse and queue request for sending to controller
+void enqueue(struct device *dev, struct client *cl, const char *line)
+{
+  char buf[4096];
+  struct request *rq = calloc(1, sizeof(*rq));
+  FILE *fp = (cl != NULL) ? cl->fp : stdout;
+  rq->cl = cl;
+  snprintf(buf, sizeof(buf), "%s", line);
+  if (dev_parked(dev))
+    dev_state(dev, DEV_DOWN, 0);
+
+  // optional class and deadline ahead of the command
+  int prio = -1;
+  for (char *opt = buf; ; ) {
+    int len = strcspn(opt, " \t\n");
+    if (strncmp(opt, "deadline=", 9) == 0)
+      rq->deadline = now_us()+atoi(opt+9)*1000LL;
+    else if (strncmp(opt, "prio=", 5) == 0) {
+      for (prio = 0; (prio < PRIO_MAX) && ((strlen(_prio[prio]) != len-5) || (strncmp(opt+5, _prio[prio], len-5) != 0)); ++prio);
+      if (prio == PRIO_MAX) {
+        snprintf(rq->name, sizeof(rq->name), "%.*s", len, opt);
+        respond(dev, rq, "invalid command");
+        return;
       }
+    } else {
+      memmove(buf, opt, strlen(opt)+1);
+      break;
     }
-
-    // if done with commands, exit or enable tty control
-    if (!tty & (argi == argc)) {
-      if ((argc > 2) && (strcmp(argv[argi-1], "-I") != 0))
-        break;
-      fprintf(stderr, "interactive mode (timeout disabled)\n");
-      lasttime += 86400;
-      tty = 1;
+    opt += len+strspn(opt+len, " \t");
+  }
+  snprintf(rq->name, sizeof(rq->name), "%.*s", (int)strcspn(buf, "\n\"\'= "), buf);
+  if (strcmp(rq->name, "queue") == 0) {
+    queue_stats(dev, fp);
+    respond(dev, rq, NULL);
+    return;
+  } else if (strcmp(rq->name, "anim") == 0) {
+    int rc = anim(dev, buf, fp);
+    respond(dev, rq, (rc < 0) ? "invalid command" : NULL);
+    // frames are plain rgb so static mode shows them
+    if (rc > 0)
+      enqueue(dev, NULL, "want power=1 mode=1 effect=1");
+    return;
+  } else if (strcmp(rq->name, "want") == 0) {
+    rq->plan = calloc(1, sizeof(*rq->plan));
+    if (want(rq->plan, buf+4+strspn(buf+4, "= "), fp) <= 0) {
+      respond(dev, rq, "invalid command");
+      return;
     }
+  } else if ((rq->len = cmdline(dev, buf, rq->req, fp)) <= 0) {
+    respond(dev, rq, (rq->len < 0) ? "invalid command" : NULL);
+    return;
+  }
+
+  // queries and slow uploads (custom, remote, onoff) queue behind interactive control
+  static const uint8_t slow[] = { 0x02, 0x08, 0x5c, 0x63 };
+  rq->prio = (prio >= 0) ? prio : ((rq->len > 4) && (memchr(slow, rq->req[4], sizeof(slow)) != NULL)) ? PRIO_NORMAL : PRIO_INTERACTIVE;
+
+  // inc/dec/want compare against parms at send time (stale cache queries first, in the same class)
+  rq->cond = (strcmp(rq->name, "inc") == 0) ? 1 : (strcmp(rq->name, "dec") == 0) ? -1 : 0;
+  if ((rq->cond || rq->plan) && !shadow_fresh(dev))
+    query_queue(dev, rq->prio);
+  if (supersede(dev, rq) >= MAX_QUEUE)
+    respond(dev, rq, "queue full");
+  else
+    append(dev, rq);
+}
+
+// begin parm query (segments already held from an interrupted query at the same width are kept)
+void query_start(struct device *dev, int width)
+{
+  if (dev->qs.active && (dev->qs.width == width))
+    return;
+  memset(dev->qs.have, 0, sizeof(dev->qs.have));
+  dev->qs.active = 1;
+  dev->qs.width = width;
+  dev->qs.seglen = (width > 9) ? width-9 : (width == 1) ? 255 : 14;
+  dev->qs.tries = 0;
+}
+
+// query segment received (bitmap lookup)
+int query_have(struct device *dev, int seg)
+{
+  return (dev->qs.have[seg/32] >> (seg%32)) & 1;
+}
+
+// place query segment by index (returns 1 once all 77+rcnt*2 bytes present, -1 if inconsistent)
+// (segments that do not fit this query's layout are leftovers of an earlier query and ignored)
+int query_segment(struct device *dev, int seg, const uint8_t *data, int len)
+{
+  int seglen = dev->qs.seglen, off = seg*seglen, rseg = 76/seglen;
+  if ((len == 0) || (len > seglen) || (off+len > sizeof(dev->qs.buf)))
+    return 0;
+  // rcnt (byte 76) fixes total length (only the final segment is short)
+  int total = query_have(dev, rseg) ? 77+dev->qs.buf[76]*2 : ((seg == rseg) && (off+len > 76)) ? 77+data[76-off]*2 : 0;
+  if ((len < seglen) && (off+len != total))
+    return 0;
+  if ((total > 0) && (off >= total))
+    return 0;
+  if (!query_have(dev, seg)) {
+    memcpy(dev->qs.buf+off, data, len);
+    dev->qs.have[seg/32] |= 1u << (seg%32);
+  }
+
+  if (!query_have(dev, rseg))
+    return 0;
+  if ((total = 77+dev->qs.buf[76]*2) > sizeof(dev->qs.buf))
+    return -1;
+  for (seg = 0; seg*seglen < total; ++seg)
+    if (!query_have(dev, seg))
+      return 0;
+  return 1;
+}
+
+// discard partial query
+void query_reset(struct device *dev)
+{
+  dev->qs.active = 0;
+  memset(dev->qs.have, 0, sizeof(dev->qs.have));
+}
+
+// resend parm query after loss or inconsistency (returns 0 once attempts exhausted)
+int query_retry(struct device *dev)
+{
+  struct request *rq = dev->busy;
+  if ((++dev->qs.tries < QUERY_RETRY) && (dev_send(dev, rq->req, rq->len) >= 0)) {
+    fprintf(stderr, "%s query retry %d (width=%d)\n", dev->addr, dev->qs.tries, dev->qs.width);
+    dev_state(dev, DEV_BUSY, QUERY_TIMEOUT);
+    return 1;
   }
-  exit(argi < argc ? EXIT_FAILURE : EXIT_SUCCESS);
+  // widths above known-good that never arrive intact likely overran the pdu
+  if ((dev->qs.width > dev->safe) && (dev->qs.width > dev->wok))
+    dev->wbad = dev->qs.width;
+  query_reset(dev);
+  return 0;
+}
+
+// build command request (header as cmdline)
+struct request *request(const char *name, int code, const uint8_t *parm, int cnt)
+{
+  struct request *rq = calloc(1, sizeof(*rq));
+  const uint8_t hdr[] = { GATT_WRITE_REQ, 0x0e, 0x00, 0x53, code, 0x00, 0x01, 0x00, cnt };
+  memcpy(rq->req, hdr, sizeof(hdr));
+  memcpy(rq->req+sizeof(hdr), parm, cnt);
+  rq->len = sizeof(hdr)+cnt;
+  rq->quiet = 1;
+  rq->prio = PRIO_BACKGROUND;
+  snprintf(rq->name, sizeof(rq->name), "%s", name);
+  return rq;
 }
 
+// expand want into fewest commands against shadow (placed at head of queue, last one reports)
+// (several changes to the mode group go as one 0x5e bulk write, single changes use their own opcode)
+void plan(struct device *dev, struct request *rq)
+{
+  if (dev->sh->queried == 0) {
+    respond(dev, rq, "parms unknown (query failed)");
+    return;
+  }
+  struct sp630e cur = dev->sh->sp, want = cur;
+  for (int i = 0; i < sizeof(want); ++i)
+    if (rq->plan->set[i])
+      ((uint8_t *)&want)[i] = ((uint8_t *)&rq->plan->sp)[i];
+#define CHANGED(f) (memcmp(&want.f, &cur.f, sizeof(want.f)) != 0)
+
+  struct request *head = NULL, **tail = &head;
+  uint8_t parm[32];
+  int cnt;
+#define EMIT(code, ...) do { \
+    const uint8_t p[] = { __VA_ARGS__ }; \
+    *tail = request("want", code, p, sizeof(p)); \
+    tail = &(*tail)->next; \
+  } while (0)
+
+  if (CHANGED(power) && want.power)
+    EMIT(0x50, want.power);
+
+  // mode group: bulk sets all 13 (rgb slot is m_rgb in music modes), otherwise one opcode per change
+  int music = (want.mode == 5) || (want.mode == 6);
+  int mode = CHANGED(mode) || CHANGED(effect), rgb = CHANGED(rgb), mrgb = CHANGED(m_rgb);
+  int level = CHANGED(level) && !rgb, v44 = CHANGED(var44) || CHANGED(var45), v34 = CHANGED(var34) || CHANGED(var35);
+  int single = mode+rgb+level+CHANGED(speed)+CHANGED(len)+CHANGED(dir)+v44+v34+mrgb;
+  if (single > 1+(music ? rgb : mrgb)) {
+    const uint8_t *c = music ? want.m_rgb : want.rgb;
+    EMIT(0x5e, want.mode, want.effect, want.level, want.speed, want.len, want.dir, want.var44, want.var45,
+        c[0], c[1], c[2], want.var34, want.var35);
+    mode = level = v44 = v34 = 0;
+    cur.speed = want.speed;
+    cur.len = want.len;
+    cur.dir = want.dir;
+    rgb &= music;
+    mrgb &= !music;
+  }
+  if (mode)
+    EMIT(0x53, want.mode, want.effect);
+  if (rgb)
+    EMIT(0x52, want.rgb[0], want.rgb[1], want.rgb[2], want.level);
+  if (level)
+    EMIT(0x51, 0, want.level);
+  if (CHANGED(speed))
+    EMIT(0x54, want.speed);
+  if (CHANGED(len))
+    EMIT(0x55, want.len);
+  if (CHANGED(dir))
+    EMIT(0x56, want.dir);
+  if (v44)
+    EMIT(0x60, want.var44, want.var45);
+  if (v34)
+    EMIT(0x61, want.var34, want.var35);
+  if (mrgb)
+    EMIT(0x57, want.m_rgb[0], want.m_rgb[1], want.m_rgb[2]);
+
+  // settings outside the mode group
+  if (CHANGED(white))
+    EMIT(0x51, 1, want.white);
+  if (CHANGED(order))
+    EMIT(0x6b, want.order);
+  if (CHANGED(loop))
+    EMIT(0x58, want.loop);
+  if (CHANGED(mic))
+    EMIT(0x59, want.mic);
+  if (CHANGED(gain))
+    EMIT(0x5a, want.gain);
+  if (CHANGED(reboot))
+    EMIT(0x0b, want.reboot);
+  if (CHANGED(oo_effect) || CHANGED(oo_speed) || CHANGED(oo_len))
+    EMIT(0x08, 1, want.oo_effect, want.oo_speed, want.oo_len[0], want.oo_len[1]);
+  if (CHANGED(cust)) {
+    parm[0] = 1;
+    for (cnt = 0; (cnt < sizeof(want.cust)/sizeof(want.cust[0])) && (want.cust[cnt].len > 0); ++cnt)
+      memcpy(parm+1+cnt*4, &want.cust[cnt], 4);
+    *tail = request("want", 0x63, parm, 1+cnt*4);
+    tail = &(*tail)->next;
+  }
+  cnt = (want.rcnt > sizeof(want.rme)/2) ? sizeof(want.rme)/2 : want.rcnt;
+  if (CHANGED(rcnt) || (memcmp(want.rme, cur.rme, cnt*2) != 0)) {
+    *tail = request("want", 0x5c, want.rme, cnt*2);
+    tail = &(*tail)->next;
+  }
+
+  if (CHANGED(power) && !want.power)
+    EMIT(0x50, want.power);
+#undef EMIT
+#undef CHANGED
+
+  // nothing to change (already matches)
+  if (head == NULL) {
+    respond(dev, rq, NULL);
+    return;
+  }
+  struct request *last = head;
+  for (struct request *q = head; q != NULL; q = q->next) {
+    q->prio = rq->prio;
+    q->queued = rq->queued;
+    q->deadline = rq->deadline;
+    last = q;
+  }
+  last->cl = rq->cl;
+  last->quiet = rq->quiet;
+  if ((last->next = dev->rqhead) == NULL)
+    dev->rqtail = last;
+  dev->rqhead = head;
+  free(rq->plan);
+  free(rq);
+}
+
+// count devices still animating
+int anim_active(void)
+{
+  int active = 0;
+  for (int i = 0; i < _ndev; ++i)
+    active += (_dev[i].an.kind != ANIM_NONE);
+  return active;
+}
+
+// render animation frame for time now as rgb+level (returns 1 once timeline finished)
+int anim_frame(struct anim *an, int64_t now, uint8_t *frame)
+{
+  int64_t t = now-an->start;
+  int64_t step = (an->step > 0) ? an->step : 1;
+  int seg = t/step, level = 255, done = 0;
+  double frac = (double)(t%step)/step;
+  const uint8_t *a, *b;
+  switch (an->kind) {
+  case ANIM_FADE:
+    // through each color in turn then hold last
+    if (seg >= an->ncolor-1) {
+      seg = an->ncolor-1;
+      frac = 0;
+      done = 1;
+    }
+    a = an->color[seg];
+    b = an->color[(seg+1 < an->ncolor) ? seg+1 : seg];
+    break;
+  case ANIM_BREATHE: {
+    // smoothstep triangle between 10% and full level (next color each breath)
+    double tri = 1-((frac < 0.5) ? 1-2*frac : 2*frac-1);
+    level = 26+229*tri*tri*(3-2*tri);
+    a = b = an->color[seg%an->ncolor];
+    frac = 0;
+    break;
+  }
+  case ANIM_VIDEO:
+    // latest video color (already gamma/white-balance corrected)
+    a = b = an->color[0];
+    frac = 0;
+    break;
+  default:
+    // loop through colors
+    a = an->color[seg%an->ncolor];
+    b = an->color[(seg+1)%an->ncolor];
+    break;
+  }
+  // rgb prescaled by level (controller uses rgb as-is)
+  for (int i = 0; i < 3; ++i)
+    frame[i] = (int)(a[i]+(b[i]-a[i])*frac)*level/255;
+  frame[3] = level;
+  return done;
+}
+
+// animation frame tick (one frame per animated device, dropped rather than queued when link is behind)
+void anim_tick(void)
+{
+  uint64_t exp = 0;
+  if (read(_animfd, &exp, sizeof(exp)) != sizeof(exp))
+    return;
+  int64_t now = now_us(), period = 1000000/_fps;
+  int64_t jitter = (_animtick > 0) ? now-_animtick-period*(int64_t)exp : 0;
+  _animtick = now;
+  if (jitter < 0)
+    jitter = -jitter;
+
+  for (int i = 0; i < _ndev; ++i) {
+    struct device *dev = &_dev[i];
+    struct anim *an = &dev->an;
+    if ((an->kind == ANIM_NONE) || (an->ncolor == 0))
+      continue;
+    // fade waits for the queried start color (first palette color if the query fails or takes too long)
+    if (an->wait && !shadow_fresh(dev) && (now-an->start < HOLD_TIMEOUT*1000000LL) &&
+        ((dev->state != DEV_READY) || (dev->rqhead != NULL) || (dev->busy != NULL)))
+      continue;
+    if (an->wait) {
+      memcpy(an->color[0], shadow_fresh(dev) ? dev->sh->sp.rgb : an->color[1], 3);
+      an->start = now;
+      an->wait = 0;
+    }
+    ++an->ticks;
+    an->dropped += exp-1;
+    an->jsum += jitter;
+    if (jitter > an->jmax)
+      an->jmax = jitter;
+
+    uint8_t frame[4];
+    int done = anim_frame(an, now, frame);
+    int sent = (an->frames > 0) && (memcmp(frame, an->last, sizeof(frame)) == 0);
+    if (!sent && ((dev->state != DEV_READY) || (dev->rqhead != NULL) || (dev->busy != NULL)))
+      ++an->dropped;
+    else if (!sent) {
+      if (an->kind == ANIM_VIDEO) {
+        // video sent as raw led channels (order remapped here rather than by controller)
+        const uint8_t *o = _order[(dev->sh->sp.order < 6) ? dev->sh->sp.order : 4];
+        uint8_t ref[3] = { frame[o[0]], frame[o[1]], frame[o[2]] };
+        append(dev, request("video", 0x6c, ref, sizeof(ref)));
+      } else
+        append(dev, request("anim", 0x52, frame, sizeof(frame)));
+      memcpy(an->last, frame, sizeof(frame));
+      ++an->frames;
+      sent = 1;
+    }
+    // finished once final frame is out
+    if (done && sent) {
+      anim_stats(dev, stderr);
+      an->kind = ANIM_NONE;
+    }
+  }
+  if (!anim_active()) {
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+    timerfd_settime(_animfd, 0, &its, NULL);
+  }
+}
+
+// audio analysis: pcm/wav stream in, onsets out as pulse (plus optional m_rgb) to every idle controller
+#define AUDIO_FFT   512    // analysis window (samples)
+#define AUDIO_HOP   256    // samples between analyses
+#define AUDIO_BANDS 6      // band levels sent with each pulse
+#define AUDIO_HOLD  100    // minimum ms between onsets
+typedef float v4f __attribute__((vector_size(16)));
+static const int _bandhz[AUDIO_BANDS+1] = { 40, 150, 400, 1000, 2500, 6000, 16000 };
+static float _hann[AUDIO_FFT] __attribute__((aligned(16)));
+static float _twr[AUDIO_FFT] __attribute__((aligned(16))), _twi[AUDIO_FFT] __attribute__((aligned(16)));
+static uint16_t _rev[AUDIO_FFT];
+static struct audio {
+  int fd, timer;     // input, pacing timer for regular files (-1=none)
+  int rate, chans, bits; // 16=s16le, 32=s32le or float
+  int flt;           // 32-bit samples are IEEE float
+  int rgb;           // follow band balance with m_rgb
+  int fill;          // bytes of current hop read so far
+  uint8_t raw[AUDIO_HOP*8*4];
+  int nsamp;         // samples in window
+  float win[AUDIO_FFT] __attribute__((aligned(16)));
+  float prev[AUDIO_FFT/2]; // previous magnitude spectrum
+  float bandmax[AUDIO_BANDS];
+  int edge[AUDIO_BANDS+1];
+  float mean, dev;   // running spectral flux mean/deviation
+  int64_t hops, onset; // hops analyzed, hop of last onset
+  int64_t onsets, pulses, dropped, asum, amax;
+} _au = { .fd = -1, .timer = -1 };
+
+// in-place radix-2 fft of bit-reversed input (per-stage twiddles at _tw[half..2*half-1])
+void fft(float *re, float *im)
+{
+  for (int half = 1; half < AUDIO_FFT; half <<= 1)
+    for (int i = 0; i < AUDIO_FFT; i += 2*half) {
+      float *ar = re+i, *ai = im+i, *br = ar+half, *bi = ai+half;
+      if (half < 4) {
+        for (int j = 0; j < half; ++j) {
+          float tr = br[j]*_twr[half+j]-bi[j]*_twi[half+j], ti = br[j]*_twi[half+j]+bi[j]*_twr[half+j];
+          br[j] = ar[j]-tr, bi[j] = ai[j]-ti;
+          ar[j] += tr, ai[j] += ti;
+        }
+        continue;
+      }
+      // four butterflies per vector (arm neon/x86 sse via gcc vector extensions)
+      for (int j = 0; j < half; j += 4) {
+        v4f wr = *(v4f *)&_twr[half+j], wi = *(v4f *)&_twi[half+j];
+        v4f xr = *(v4f *)&br[j], xi = *(v4f *)&bi[j], yr = *(v4f *)&ar[j], yi = *(v4f *)&ai[j];
+        v4f tr = xr*wr-xi*wi, ti = xr*wi+xi*wr;
+        *(v4f *)&br[j] = yr-tr, *(v4f *)&bi[j] = yi-ti;
+        *(v4f *)&ar[j] = yr+tr, *(v4f *)&ai[j] = yi+ti;
+      }
+    }
+}
+
+// analyze current window (returns onset strength 0..255 or 0 for none, band levels in level)
+int audio_analyze(struct audio *au, uint8_t *level)
+{
+  static float re[AUDIO_FFT] __attribute__((aligned(16))), im[AUDIO_FFT] __attribute__((aligned(16)));
+  static float pw[AUDIO_FFT/2] __attribute__((aligned(16)));
+  for (int i = 0; i < AUDIO_FFT; i += 4) {
+    v4f w = *(v4f *)&au->win[i]*(*(v4f *)&_hann[i]);
+    *(v4f *)&re[i] = w;
+    *(v4f *)&im[i] = (v4f) { 0 };
+  }
+  for (int i = 0; i < AUDIO_FFT; ++i)
+    if (_rev[i] > i) {
+      float t = re[i];
+      re[i] = re[_rev[i]], re[_rev[i]] = t;
+    }
+  fft(re, im);
+  for (int i = 0; i < AUDIO_FFT/2; i += 4) {
+    v4f r = *(v4f *)&re[i], m = *(v4f *)&im[i];
+    *(v4f *)&pw[i] = r*r+m*m;
+  }
+
+  // spectral flux (magnitude rise) and band energy
+  float flux = 0, band[AUDIO_BANDS] = { 0 };
+  for (int i = 1; i < AUDIO_FFT/2; ++i) {
+    float mag = sqrtf(pw[i]);
+    if (mag > au->prev[i])
+      flux += mag-au->prev[i];
+    au->prev[i] = mag;
+  }
+  for (int b = 0; b < AUDIO_BANDS; ++b) {
+    for (int i = au->edge[b]; i < au->edge[b+1]; ++i)
+      band[b] += pw[i];
+    // auto-gain against slowly decaying peak
+    au->bandmax[b] = (band[b] > au->bandmax[b]*0.995f) ? band[b] : au->bandmax[b]*0.995f;
+    level[b] = (au->bandmax[b] > 0) ? 255*sqrtf(band[b]/au->bandmax[b]) : 0;
+  }
+
+  // onset once flux clears adaptive threshold (mean+1.5*deviation) outside hold time
+  float over = flux-au->mean-1.5f*au->dev;
+  int strength = 0;
+  int hold = (int64_t)AUDIO_HOLD*au->rate/(1000*AUDIO_HOP);
+  if ((au->hops > 8) && (over > 0) && (au->hops-au->onset > hold)) {
+    strength = 64+over*191/(2.5f*au->dev+1e-6f);
+    strength = (strength > 255) ? 255 : strength;
+    au->onset = au->hops;
+  }
+  au->mean += 0.05f*(flux-au->mean);
+  au->dev += 0.05f*(((flux > au->mean) ? flux-au->mean : au->mean-flux)-au->dev);
+  ++au->hops;
+  return strength;
+}
+
+// send pulse <strength> <band levels> (and m_rgb of bass:mid:treble) to every idle controller
+void audio_pulse(int strength, const uint8_t *level)
+{
+  uint8_t parm[1+AUDIO_BANDS] = { strength };
+  memcpy(parm+1, level, AUDIO_BANDS);
+  int r = level[0] > level[1] ? level[0] : level[1], g = level[2] > level[3] ? level[2] : level[3], b = level[4] > level[5] ? level[4] : level[5];
+  int max = (r > g) ? ((r > b) ? r : b) : ((g > b) ? g : b);
+  uint8_t rgb[3] = { r*255/(max+1), g*255/(max+1), b*255/(max+1) };
+  ++_au.onsets;
+  for (int i = 0; i < _ndev; ++i) {
+    struct device *dev = &_dev[i];
+    // late beats are worse than missing ones
+    if ((dev->state != DEV_READY) || (dev->rqhead != NULL) || (dev->busy != NULL)) {
+      ++_au.dropped;
+      continue;
+    }
+    if (_au.rgb && (memcmp(dev->sh->sp.m_rgb, rgb, 3) != 0))
+      append(dev, request("audio", 0x57, rgb, 3));
+    append(dev, request("audio", 0x5b, parm, sizeof(parm)));
+    ++_au.pulses;
+  }
+}
+
+// show audio stats
+void audio_stats(FILE *fp)
+{
+  fprintf(fp, "audio rate=%d hop=%.1fms hops=%lld onsets=%lld pulses=%lld dropped=%lld analysis=%lld/%lldus\n", _au.rate,
+      AUDIO_HOP*1000.0/_au.rate, (long long)_au.hops, (long long)_au.onsets, (long long)_au.pulses, (long long)_au.dropped,
+      (long long)(_au.hops ? _au.asum/_au.hops : 0), (long long)_au.amax);
+}
+
+// read available input (a hop per timer tick for files), analyzing each full hop
+void audio_read(int tick)
+{
+  uint64_t exp = 0;
+  int frame = _au.chans*_au.bits/8, hopbytes = AUDIO_HOP*frame;
+  if (tick && (read(_au.timer, &exp, sizeof(exp)) != sizeof(exp)))
+    return;
+  for (;;) {
+    int n = read(_au.fd, _au.raw+_au.fill, hopbytes-_au.fill);
+    if (n == 0) {
+      audio_stats(stderr);
+      close(_au.fd);
+      if (_au.timer >= 0)
+        close(_au.timer);
+      _au.fd = _au.timer = -1;
+      return;
+    }
+    if (n < 0)
+      return;
+    if ((_au.fill += n) < hopbytes)
+      continue;
+    _au.fill = 0;
+
+    // downmix hop into window
+    memmove(_au.win, _au.win+AUDIO_HOP, (AUDIO_FFT-AUDIO_HOP)*sizeof(float));
+    float *out = _au.win+AUDIO_FFT-AUDIO_HOP;
+    for (int i = 0; i < AUDIO_HOP; ++i) {
+      float sum = 0;
+      for (int c = 0; c < _au.chans; ++c)
+        sum += (_au.bits == 16) ? ((int16_t *)_au.raw)[i*_au.chans+c]/32768.0f :
+               _au.flt ? ((float *)_au.raw)[i*_au.chans+c] : ((int32_t *)_au.raw)[i*_au.chans+c]/2147483648.0f;
+      out[i] = sum/_au.chans;
+    }
+    if ((_au.nsamp += AUDIO_HOP) < AUDIO_FFT)
+      continue;
+    _au.nsamp = AUDIO_FFT;
+
+    int64_t start = now_us();
+    uint8_t level[AUDIO_BANDS];
+    int strength = audio_analyze(&_au, level);
+    if (strength > 0)
+      audio_pulse(strength, level);
+    int64_t t = now_us()-start;
+    _au.asum += t;
+    _au.amax = (t > _au.amax) ? t : _au.amax;
+    if (tick && (--exp == 0))
+      return;
+  }
+}
+
+// set up analysis tables for sample rate
+void audio_init(struct audio *au)
+{
+  for (int i = 0; i < AUDIO_FFT; ++i) {
+    _hann[i] = 0.5f-0.5f*cosf(2*M_PI*i/AUDIO_FFT);
+    _rev[i] = 0;
+    for (int b = 1, r = i; b < AUDIO_FFT; b <<= 1, r >>= 1)
+      _rev[i] = (_rev[i] << 1)|(r&1);
+  }
+  for (int half = 1; half < AUDIO_FFT; half <<= 1)
+    for (int j = 0; j < half; ++j) {
+      _twr[half+j] = cosf(-M_PI*j/half);
+      _twi[half+j] = sinf(-M_PI*j/half);
+    }
+  for (int b = 0; b <= AUDIO_BANDS; ++b) {
+    au->edge[b] = ((int64_t)_bandhz[b]*AUDIO_FFT+au->rate/2)/au->rate;
+    au->edge[b] = (au->edge[b] < 1) ? 1 : (au->edge[b] > AUDIO_FFT/2) ? AUDIO_FFT/2 : au->edge[b];
+  }
+}
+
+// open pcm/wav input (path[,rate[,channels]], - for stdin, raw pcm is s16le) and hook into event loop
+int audio_open(const char *spec)
+{
+  char path[256];
+  snprintf(path, sizeof(path), "%s", spec);
+  char *opt = strchr(path, ',');
+  _au.rate = 44100, _au.chans = 1, _au.bits = 16, _au.flt = 0;
+  if (opt != NULL) {
+    *opt++ = 0;
+    _au.rate = atoi(opt);
+    if ((opt = strchr(opt, ',')) != NULL)
+      _au.chans = atoi(opt+1);
+  }
+  int fd = (strcmp(path, "-") == 0) ? dup(0) : open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "audio %s: %s (%d)\n", path, strerror(errno), errno);
+    return -1;
+  }
+
+  // wav header (fmt chunk then data), otherwise the bytes read are samples
+  uint8_t hdr[12];
+  int n = 0, fmt = 1;
+  for (int rc; (n < sizeof(hdr)) && ((rc = read(fd, hdr+n, sizeof(hdr)-n)) > 0); n += rc);
+  if ((n == sizeof(hdr)) && (memcmp(hdr, "RIFF", 4) == 0) && (memcmp(hdr+8, "WAVE", 4) == 0)) {
+    uint8_t chunk[8], buf[64];
+    for (n = 0; ; n = 0) {
+      for (int rc; (n < sizeof(chunk)) && ((rc = read(fd, chunk+n, sizeof(chunk)-n)) > 0); n += rc);
+      uint32_t size = chunk[4]|(chunk[5] << 8)|(chunk[6] << 16)|((uint32_t)chunk[7] << 24);
+      if ((n < sizeof(chunk)) || (memcmp(chunk, "data", 4) == 0))
+        break;
+      for (uint32_t left = size+(size&1), rc; left > 0; left -= rc) {
+        if ((rc = read(fd, buf, (left < sizeof(buf)) ? left : sizeof(buf))) <= 0)
+          break;
+        if ((memcmp(chunk, "fmt ", 4) == 0) && (left == size+(size&1)) && (rc >= 16)) {
+          fmt = buf[0]|(buf[1] << 8);
+          _au.chans = buf[2]|(buf[3] << 8);
+          _au.rate = buf[4]|(buf[5] << 8)|(buf[6] << 16)|(buf[7] << 24);
+          _au.bits = buf[14]|(buf[15] << 8);
+          // extensible: the sub-format GUID starts with the real format tag
+          if ((fmt == 0xfffe) && (rc >= 26))
+            fmt = buf[24]|(buf[25] << 8);
+        }
+      }
+    }
+    n = 0;
+  } else
+    memcpy(_au.raw, hdr, n);
+  _au.fill = n;
+  if ((((fmt != 1) || ((_au.bits != 16) && (_au.bits != 32))) && ((fmt != 3) || (_au.bits != 32))) || (_au.chans < 1) || (_au.chans > 8) ||
+      (_au.rate < 8000)) {
+    fprintf(stderr, "audio %s: unsupported format (fmt=%d bits=%d channels=%d rate=%d)\n", path, fmt, _au.bits, _au.chans, _au.rate);
+    close(fd);
+    return -1;
+  }
+  _au.flt = (fmt == 3);
+  audio_init(&_au);
+  _au.fd = fd;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK);
+
+  // files are paced at real time, pipes deliver at capture rate
+  struct stat st;
+  struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EV_AUDIO };
+  if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode)) {
+    _au.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    long period = AUDIO_HOP*1000000000LL/_au.rate;
+    struct itimerspec its = { { 0, period }, { 0, period } };
+    timerfd_settime(_au.timer, 0, &its, NULL);
+    ev.data.u32 |= 1;
+    epoll_ctl(_epfd, EPOLL_CTL_ADD, _au.timer, &ev);
+  } else
+    epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev);
+  return 0;
+}
+
+// video ambient color: raw rgb24/yuv420p frames reduced row by row into a cell grid (fixed memory),
+// region colors shown via the frame timer as ref (raw led channels)
+#define VIDEO_GX 16
+#define VIDEO_GY 9
+enum { VIDEO_DOMINANT, VIDEO_AVERAGE, VIDEO_TOP, VIDEO_BOTTOM, VIDEO_LEFT, VIDEO_RIGHT, VIDEO_REGIONS };
+static const char *_region[] = { "dominant", "average", "top", "bottom", "left", "right" };
+static struct video {
+  int fd, timer;     // input, pacing timer for regular files (-1=none)
+  int w, h, yuv;     // frame geometry, 0=rgb24 1=yuv420p
+  int plane, row, fill; // read position (plane 0 only for rgb24)
+  uint8_t *buf;      // one row
+  uint32_t sum[VIDEO_GY][VIDEO_GX][3], cnt[VIDEO_GY][VIDEO_GX][3];
+  float gamma;       // video to led gamma
+  int wb[3];         // white balance (led value for full-scale channel)
+  uint8_t lut[3][256];
+  uint8_t color[VIDEO_REGIONS][3];
+  const char *simd;  // reduction kernel in use
+  int64_t frames, cur, psum, pmax; // reduction time per frame (us)
+} _vid = { .fd = -1, .timer = -1, .gamma = 2.2, .wb = { 255, 255, 255 } };
+
+// reduction kernels: sum of n bytes, and per-channel sums of n rgb24 pixels
+// (rgb24 byte at offset o is channel o%3, so one 96-byte mask per channel covers three 32-byte vectors)
+static uint8_t _rgbmask[3][96] __attribute__((aligned(32)));
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+uint32_t sum_u8_sse2(const uint8_t *p, int n)
+{
+  __m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+  int i = 0;
+  for (; i+16 <= n; i += 16)
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(p+i)), zero));
+  uint32_t sum = _mm_cvtsi128_si32(acc)+_mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+  for (; i < n; ++i)
+    sum += p[i];
+  return sum;
+}
+
+// 48 bytes (16 pixels) per step, each u16 lane always holding the same channel
+void sum_rgb_sse2(const uint8_t *p, int n, uint32_t *sum)
+{
+  __m128i zero = _mm_setzero_si128();
+  int i = 0;
+  while (i+16 <= n) {
+    __m128i acc[6] = { zero, zero, zero, zero, zero, zero };
+    for (int blk = 0; (blk < 256) && (i+16 <= n); ++blk, i += 16)
+      for (int j = 0; j < 3; ++j) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p+i*3+j*16));
+        acc[j*2] = _mm_add_epi16(acc[j*2], _mm_unpacklo_epi8(v, zero));
+        acc[j*2+1] = _mm_add_epi16(acc[j*2+1], _mm_unpackhi_epi8(v, zero));
+      }
+    uint16_t lane[48];
+    memcpy(lane, acc, sizeof(lane));
+    for (int k = 0; k < 48; k += 3)
+      sum[0] += lane[k], sum[1] += lane[k+1], sum[2] += lane[k+2];
+  }
+  for (; i < n; ++i)
+    sum[0] += p[i*3], sum[1] += p[i*3+1], sum[2] += p[i*3+2];
+}
+
+__attribute__((target("avx2"))) uint32_t sum_u8_avx2(const uint8_t *p, int n)
+{
+  __m256i acc = _mm256_setzero_si256(), zero = _mm256_setzero_si256();
+  int i = 0;
+  for (; i+32 <= n; i += 32)
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(p+i)), zero));
+  uint64_t lane[4];
+  memcpy(lane, &acc, sizeof(lane));
+  uint32_t sum = lane[0]+lane[1]+lane[2]+lane[3];
+  for (; i < n; ++i)
+    sum += p[i];
+  return sum;
+}
+
+// 96 bytes (32 pixels) per step, channel bytes picked by mask then summed by sad (no lane flush)
+__attribute__((target("avx2"))) void sum_rgb_avx2(const uint8_t *p, int n, uint32_t *sum)
+{
+  __m256i zero = _mm256_setzero_si256(), acc[3] = { zero, zero, zero };
+  int i = 0;
+  for (; i+32 <= n; i += 32)
+    for (int j = 0; j < 3; ++j) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(p+i*3+j*32));
+      for (int c = 0; c < 3; ++c)
+        acc[c] = _mm256_add_epi64(acc[c], _mm256_sad_epu8(_mm256_and_si256(v, _mm256_load_si256((const __m256i *)(_rgbmask[c]+j*32))), zero));
+    }
+  for (int c = 0; c < 3; ++c) {
+    uint64_t lane[4];
+    memcpy(lane, &acc[c], sizeof(lane));
+    sum[c] += lane[0]+lane[1]+lane[2]+lane[3];
+  }
+  for (; i < n; ++i)
+    sum[0] += p[i*3], sum[1] += p[i*3+1], sum[2] += p[i*3+2];
+}
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+uint32_t sum_u8_neon(const uint8_t *p, int n)
+{
+  uint32x4_t acc = vdupq_n_u32(0);
+  int i = 0;
+  for (; i+16 <= n; i += 16)
+    acc = vpadalq_u16(acc, vpaddlq_u8(vld1q_u8(p+i)));
+  uint32_t sum = vgetq_lane_u32(acc, 0)+vgetq_lane_u32(acc, 1)+vgetq_lane_u32(acc, 2)+vgetq_lane_u32(acc, 3);
+  for (; i < n; ++i)
+    sum += p[i];
+  return sum;
+}
+
+// vld3 deinterleaves 16 pixels into r/g/b vectors
+void sum_rgb_neon(const uint8_t *p, int n, uint32_t *sum)
+{
+  int i = 0;
+  while (i+16 <= n) {
+    uint16x8_t acc[3] = { vdupq_n_u16(0), vdupq_n_u16(0), vdupq_n_u16(0) };
+    for (int blk = 0; (blk < 128) && (i+16 <= n); ++blk, i += 16) {
+      uint8x16x3_t v = vld3q_u8(p+i*3);
+      for (int c = 0; c < 3; ++c)
+        acc[c] = vpadalq_u8(acc[c], v.val[c]);
+    }
+    for (int c = 0; c < 3; ++c) {
+      uint32x4_t v = vpaddlq_u16(acc[c]);
+      sum[c] += vgetq_lane_u32(v, 0)+vgetq_lane_u32(v, 1)+vgetq_lane_u32(v, 2)+vgetq_lane_u32(v, 3);
+    }
+  }
+  for (; i < n; ++i)
+    sum[0] += p[i*3], sum[1] += p[i*3+1], sum[2] += p[i*3+2];
+}
+#endif
+
+uint32_t sum_u8_scalar(const uint8_t *p, int n)
+{
+  uint32_t sum = 0;
+  for (int i = 0; i < n; ++i)
+    sum += p[i];
+  return sum;
+}
+
+void sum_rgb_scalar(const uint8_t *p, int n, uint32_t *sum)
+{
+  for (int i = 0; i < n; ++i)
+    sum[0] += p[i*3], sum[1] += p[i*3+1], sum[2] += p[i*3+2];
+}
+
+static uint32_t (*_sum_u8)(const uint8_t *p, int n) = sum_u8_scalar;
+static void (*_sum_rgb)(const uint8_t *p, int n, uint32_t *sum) = sum_rgb_scalar;
+
+// pick widest reduction kernel cpu supports (SPE6_SIMD=scalar forces fallback)
+void video_simd(struct video *vid)
+{
+  const char *force = getenv("SPE6_SIMD");
+  for (int i = 0; i < sizeof(_rgbmask[0]); ++i)
+    for (int c = 0; c < 3; ++c)
+      _rgbmask[c][i] = (i%3 == c) ? 0xff : 0;
+  vid->simd = "scalar";
+  if ((force != NULL) && (strcmp(force, "scalar") == 0))
+    return;
+#if defined(__x86_64__) || defined(__i386__)
+  _sum_u8 = sum_u8_sse2, _sum_rgb = sum_rgb_sse2, vid->simd = "sse2";
+  if (__builtin_cpu_supports("avx2") && ((force == NULL) || (strcmp(force, "sse2") != 0)))
+    _sum_u8 = sum_u8_avx2, _sum_rgb = sum_rgb_avx2, vid->simd = "avx2";
+#elif defined(__ARM_NEON)
+  _sum_u8 = sum_u8_neon, _sum_rgb = sum_rgb_neon, vid->simd = "neon";
+#endif
+}
+
+// plane geometry (rgb24 is one 3-byte plane, yuv420p is y then half-size u and v)
+void video_plane(struct video *vid, int plane, int *w, int *h, int *bpp)
+{
+  *w = vid->w, *h = vid->h, *bpp = vid->yuv ? 1 : 3;
+  if (plane > 0)
+    *w = (vid->w+1)/2, *h = (vid->h+1)/2;
+}
+
+// fold one row into its grid cells
+void video_row(struct video *vid, const uint8_t *row)
+{
+  int w, h, bpp;
+  video_plane(vid, vid->plane, &w, &h, &bpp);
+  int cy = vid->row*VIDEO_GY/h;
+  for (int cx = 0; cx < VIDEO_GX; ++cx) {
+    int x0 = cx*w/VIDEO_GX, n = (cx+1)*w/VIDEO_GX-x0;
+    uint32_t *sum = vid->sum[cy][cx], *cnt = vid->cnt[cy][cx];
+    if (bpp == 3) {
+      _sum_rgb(row+x0*3, n, sum);
+      cnt[0] += n, cnt[1] += n, cnt[2] += n;
+    } else {
+      sum[vid->plane] += _sum_u8(row+x0, n);
+      cnt[vid->plane] += n;
+    }
+  }
+}
+
+// grid to region colors (dominant is the hue bucket with most chroma-weighted area)
+void video_frame(struct video *vid)
+{
+  int64_t bucket[13][4] = { 0 }, region[VIDEO_REGIONS][4] = { 0 };
+  for (int cy = 0; cy < VIDEO_GY; ++cy)
+    for (int cx = 0; cx < VIDEO_GX; ++cx) {
+      int c[3];
+      for (int i = 0; i < 3; ++i)
+        c[i] = vid->cnt[cy][cx][i] ? vid->sum[cy][cx][i]/vid->cnt[cy][cx][i] : 0;
+      if (vid->yuv) {
+        // bt.601 limited range
+        int y = c[0]-16, u = c[1]-128, v = c[2]-128;
+        c[0] = (298*y+409*v+128) >> 8, c[1] = (298*y-100*u-208*v+128) >> 8, c[2] = (298*y+516*u+128) >> 8;
+        for (int i = 0; i < 3; ++i)
+          c[i] = (c[i] < 0) ? 0 : (c[i] > 255) ? 255 : c[i];
+      }
+      memset(vid->sum[cy][cx], 0, sizeof(vid->sum[cy][cx]));
+      memset(vid->cnt[cy][cx], 0, sizeof(vid->cnt[cy][cx]));
+
+      int max = (c[0] > c[1]) ? ((c[0] > c[2]) ? c[0] : c[2]) : ((c[1] > c[2]) ? c[1] : c[2]);
+      int min = (c[0] < c[1]) ? ((c[0] < c[2]) ? c[0] : c[2]) : ((c[1] < c[2]) ? c[1] : c[2]);
+      int chroma = max-min, hue = 0, b = 12;
+      if (chroma >= 24) {
+        hue = (max == c[0]) ? 60*(c[1]-c[2])/chroma : (max == c[1]) ? 120+60*(c[2]-c[0])/chroma : 240+60*(c[0]-c[1])/chroma;
+        b = ((hue+360)%360)/30;
+      }
+      bucket[b][0] += chroma+1;
+      for (int i = 0; i < 3; ++i)
+        bucket[b][i+1] += (int64_t)(chroma+1)*c[i];
+      int in[VIDEO_REGIONS] = { 0, 1, cy == 0, cy == VIDEO_GY-1, cx == 0, cx == VIDEO_GX-1 };
+      for (int r = VIDEO_AVERAGE; r < VIDEO_REGIONS; ++r)
+        if (in[r]) {
+          ++region[r][0];
+          for (int i = 0; i < 3; ++i)
+            region[r][i+1] += c[i];
+        }
+    }
+  int best = 0;
+  for (int b = 1; b < 13; ++b)
+    best = (bucket[b][0] > bucket[best][0]) ? b : best;
+  memcpy(region[VIDEO_DOMINANT], bucket[best], sizeof(region[0]));
+  for (int r = 0; r < VIDEO_REGIONS; ++r)
+    for (int i = 0; i < 3; ++i)
+      vid->color[r][i] = vid->lut[i][region[r][0] ? region[r][i+1]/region[r][0] : 0];
+
+  for (int i = 0; i < _ndev; ++i)
+    if (_dev[i].an.kind == ANIM_VIDEO) {
+      memcpy(_dev[i].an.color[0], vid->color[_dev[i].an.region], 3);
+      _dev[i].an.ncolor = 1;
+    }
+}
+
+// show video stats
+void video_stats(FILE *fp)
+{
+  fprintf(fp, "video %dx%d %s simd=%s frames=%lld reduce=%lld/%lldus\n", _vid.w, _vid.h, _vid.yuv ? "yuv420p" : "rgb24", _vid.simd,
+      (long long)_vid.frames, (long long)(_vid.frames ? _vid.psum/_vid.frames : 0), (long long)_vid.pmax);
+}
+
+// read available input (a frame per timer tick for files), reducing each full row
+void video_read(int tick)
+{
+  uint64_t exp = 0;
+  if (tick && (read(_vid.timer, &exp, sizeof(exp)) != sizeof(exp)))
+    return;
+  for (;;) {
+    int w, h, bpp;
+    video_plane(&_vid, _vid.plane, &w, &h, &bpp);
+    int n = read(_vid.fd, _vid.buf+_vid.fill, w*bpp-_vid.fill);
+    if (n == 0) {
+      video_stats(stderr);
+      for (int i = 0; i < _ndev; ++i)
+        if (_dev[i].an.kind == ANIM_VIDEO) {
+          anim_stats(&_dev[i], stderr);
+          _dev[i].an.kind = ANIM_NONE;
+        }
+      close(_vid.fd);
+      if (_vid.timer >= 0)
+        close(_vid.timer);
+      _vid.fd = _vid.timer = -1;
+      return;
+    }
+    if (n < 0)
+      return;
+    if ((_vid.fill += n) < w*bpp)
+      continue;
+    _vid.fill = 0;
+
+    int64_t start = now_us();
+    video_row(&_vid, _vid.buf);
+    if (++_vid.row >= h) {
+      _vid.row = 0;
+      if (++_vid.plane >= (_vid.yuv ? 3 : 1)) {
+        _vid.plane = 0;
+        video_frame(&_vid);
+        ++_vid.frames;
+        _vid.cur += now_us()-start;
+        _vid.psum += _vid.cur;
+        _vid.pmax = (_vid.cur > _vid.pmax) ? _vid.cur : _vid.pmax;
+        _vid.cur = 0;
+        if (tick && (--exp == 0))
+          return;
+        continue;
+      }
+    }
+    _vid.cur += now_us()-start;
+  }
+}
+
+// set up kernels and gamma/white-balance table
+void video_init(struct video *vid)
+{
+  video_simd(vid);
+  for (int i = 0; i < 3; ++i)
+    for (int v = 0; v < 256; ++v)
+      vid->lut[i][v] = powf(v/255.0f, vid->gamma)*vid->wb[i]+0.5f;
+}
+
+// open raw video input (path,<w>x<h>[,rgb24|yuv420p][,region:region...], - for stdin) and start devices showing it
+int video_open(const char *spec)
+{
+  char path[256];
+  snprintf(path, sizeof(path), "%s", spec);
+  char *opt[4] = { NULL }, *tok = NULL;
+  strtok_r(path, ",", &tok);
+  for (int i = 0; i < 4; ++i)
+    opt[i] = strtok_r(NULL, ",", &tok);
+  if ((opt[0] == NULL) || (sscanf(opt[0], "%dx%d", &_vid.w, &_vid.h) != 2) || (_vid.w < VIDEO_GX) || (_vid.h < VIDEO_GY) || (_vid.w > 8192)) {
+    fprintf(stderr, "video %s: need <w>x<h> (at least %dx%d)\n", path, VIDEO_GX, VIDEO_GY);
+    return -1;
+  }
+  if ((opt[1] != NULL) && (strcmp(opt[1], "yuv420p") == 0))
+    _vid.yuv = 1;
+  else if ((opt[1] != NULL) && (strcmp(opt[1], "rgb24") != 0))
+    opt[2] = opt[1];
+  // region per device in device order (last one repeats)
+  int region[MAX_DEVICE] = { VIDEO_DOMINANT }, nreg = 0;
+  for (char *r = (opt[2] != NULL) ? strtok_r(opt[2], ":", &tok) : NULL; (r != NULL) && (nreg < MAX_DEVICE); r = strtok_r(NULL, ":", &tok)) {
+    int k = 0;
+    while ((k < VIDEO_REGIONS) && (strcmp(r, _region[k]) != 0))
+      ++k;
+    if (k == VIDEO_REGIONS) {
+      fprintf(stderr, "video %s: unknown region %s (dominant|average|top|bottom|left|right)\n", path, r);
+      return -1;
+    }
+    region[nreg++] = k;
+  }
+  int fd = (strcmp(path, "-") == 0) ? dup(0) : open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "video %s: %s (%d)\n", path, strerror(errno), errno);
+    return -1;
+  }
+  _vid.buf = malloc(_vid.w*3);
+  video_init(&_vid);
+  _vid.fd = fd;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK);
+
+  for (int i = 0; i < _ndev; ++i) {
+    struct anim *an = &_dev[i].an;
+    memset(an, 0, sizeof(*an));
+    an->kind = ANIM_VIDEO;
+    an->start = now_us();
+    an->region = region[(i < nreg) ? i : (nreg > 0) ? nreg-1 : 0];
+  }
+  anim_timer();
+
+  // files are paced at --fps, pipes deliver at capture rate
+  struct stat st;
+  struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EV_VIDEO };
+  if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode)) {
+    _vid.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    struct itimerspec its = { { 0, 1000000000L/_fps }, { 0, 1000000000L/_fps } };
+    if (_fps == 1)
+      its.it_interval = its.it_value = (struct timespec) { 1, 0 };
+    timerfd_settime(_vid.timer, 0, &its, NULL);
+    ev.data.u32 |= 1;
+    epoll_ctl(_epfd, EPOLL_CTL_ADD, _vid.timer, &ev);
+  } else
+    epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev);
+  return 0;
+}
+
+// binary command ring (local producer submits without text parsing or a syscall per command)
+static struct {
+  struct spe6_ring *r;
+  int timer;         // poll timer (timerfd)
+  int idle;          // polling at RING_IDLE_POLL
+  int64_t active;    // last slot taken (us)
+  int64_t taken;     // slots taken
+} _ring = { NULL, -1 };
+
+// poll timer interval (us)
+void ring_timer(int64_t us)
+{
+  struct itimerspec its = { { us/1000000, us%1000000*1000 }, { us/1000000, us%1000000*1000 } };
+  timerfd_settime(_ring.timer, 0, &its, NULL);
+}
+
+// take published slots (each queued as its command, status written back on response)
+void ring_poll(int tick)
+{
+  uint64_t exp = 0;
+  struct spe6_ring *r = _ring.r;
+  if (tick && (read(_ring.timer, &exp, sizeof(exp)) != sizeof(exp)))
+    return;
+  if (r == NULL)
+    return;
+  uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+  // poll fast only while a producer is active (an idle daemon wakes every RING_IDLE_POLL ms)
+  int64_t now = now_us();
+  if (head != r->tail)
+    _ring.active = now;
+  if (_ring.idle != (now-_ring.active > RING_IDLE*1000LL)) {
+    _ring.idle = !_ring.idle;
+    ring_timer(_ring.idle ? RING_IDLE_POLL*1000LL : RING_POLL);
+  }
+  for (uint32_t tail = r->tail; tail != head; ++tail, ++_ring.taken) {
+    struct spe6_slot *slot = &r->slot[tail&(r->slots-1)];
+    if ((slot->dev >= _ndev) || (slot->cnt > sizeof(slot->parm))) {
+      __atomic_store_n(&slot->status, SPE6_EINVAL, __ATOMIC_RELEASE);
+      continue;
+    }
+    struct device *dev = &_dev[slot->dev];
+    struct request *rq = request("ring", slot->code, slot->parm, slot->cnt);
+    rq->slot = slot;
+    rq->quiet = 0;
+    rq->prio = (slot->prio < PRIO_MAX) ? slot->prio : PRIO_BACKGROUND;
+    rq->deadline = slot->deadline ? now_us()+slot->deadline*1000LL : 0;
+    if (dev_parked(dev))
+      dev_state(dev, DEV_DOWN, 0);
+    if (supersede(dev, rq) >= MAX_QUEUE)
+      respond(dev, rq, "queue full");
+    else
+      append(dev, rq);
+  }
+  __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+}
+
+// create binary command ring (path[,slots]) shared with a producer process and start polling it
+int ring_open(const char *spec)
+{
+  char path[256];
+  snprintf(path, sizeof(path), "%s", spec);
+  char *opt = strchr(path, ',');
+  int slots = 2, want = RING_SLOTS;
+  if (opt != NULL) {
+    *opt++ = 0;
+    want = atoi(opt);
+  }
+  while ((slots < want) && (slots < 65536))
+    slots <<= 1;
+  size_t size = sizeof(struct spe6_ring)+slots*sizeof(struct spe6_slot);
+  struct spe6_ring *r = MAP_FAILED;
+  // owner only (ring slots are controller commands), including a ring file left by an earlier run
+  int fd = open(path, O_RDWR|O_CREAT|O_NOFOLLOW, 0600);
+  // truncate first so a ring left by an earlier run starts empty
+  if ((fd >= 0) && (fchmod(fd, 0600) == 0) && (ftruncate(fd, 0) == 0) && (ftruncate(fd, size) == 0))
+    r = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (fd >= 0)
+    close(fd);
+  if (r == MAP_FAILED) {
+    fprintf(stderr, "ring %s: %s (%d)\n", path, strerror(errno), errno);
+    return -1;
+  }
+  r->slots = slots;
+  r->ndev = _ndev;
+  __atomic_store_n(&r->magic, SPE6_RING_MAGIC, __ATOMIC_RELEASE);
+  _ring.r = r;
+
+  _ring.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  _ring.active = now_us();
+  ring_timer(RING_POLL);
+  struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EV_RING };
+  epoll_ctl(_epfd, EPOLL_CTL_ADD, _ring.timer, &ev);
+  fprintf(stderr, "ring %s slots=%d devices=%d\n", path, slots, _ndev);
+  return 0;
+}
+
+// send next queued request(s) once controller is idle and the rate limiter allows
+// (window > 1 sends consecutive writes as write commands and confirms only the last of each batch)
+void dispatch(struct device *dev)
+{
+  if ((dev->state != DEV_READY) || (dev->rqhead == NULL))
+    return;
+  int64_t now = now_us();
+  if (now < dev->pace) {
+    dev->limited = 1;
+    return;
+  }
+
+  struct request *end = NULL;
+  int window = dev_window(dev), sent = 0;
+  for (int n = 0; (n < window) && (dev->rqhead != NULL); ++n) {
+    struct request *rq = dev->rqhead;
+    if ((dev->rqhead = rq->next) == NULL)
+      dev->rqtail = NULL;
+    rq->next = NULL;
+
+    // expand want into commands now that parms are known
+    if (rq->plan != NULL) {
+      plan(dev, rq);
+      --n;
+      continue;
+    }
+
+    // too late to be useful
+    if ((rq->deadline > 0) && (now > rq->deadline)) {
+      ++dev->pq[rq->prio].expired;
+      respond(dev, rq, "deadline");
+      --n;
+      continue;
+    }
+
+    // skip inc/dec when level already past target
+    const struct sp630e *sp = &dev->sh->sp;
+    if (rq->cond && (dev->sh->queried > 0) && ((rq->cond > 0) ? (sp->level > rq->req[10]) : (sp->level < rq->req[10]))) {
+      rq->len = 0;
+      respond(dev, rq, NULL);
+      --n;
+      continue;
+    }
+
+    // queries (and whatever ends the batch) need a response
+    int last = (n+1 >= window) || (dev->rqhead == NULL) || (rq->req[4] == 0x02) || (dev->rqhead->req[4] == 0x02);
+    rq->req[0] = last ? GATT_WRITE_REQ : GATT_WRITE_CMD;
+    int rc = dev_send(dev, rq->req, rq->len);
+    if (_verbose) {
+      fprintf(stderr, "send(%d): ", rq->len);
+      for (int i = 0; i < rq->len; ++i)
+        fprintf(stderr, "%02x ", rq->req[i]);
+      fprintf(stderr, "(rc=%d)\n", rc);
+    }
+    if (rc < 0) {
+      respond(dev, rq, strerror(errno));
+      break;
+    }
+    if (rq->req[4] == 0x02)
+      query_start(dev, (rq->req[8] > 0) ? rq->req[9] : 0);
+    rq->sent = now_us();
+    ++dev->pq[rq->prio].sent;
+    dev->pq[rq->prio].wsum += rq->sent-rq->queued;
+    if (rq->sent-rq->queued > dev->pq[rq->prio].wmax)
+      dev->pq[rq->prio].wmax = rq->sent-rq->queued;
+    if ((rq->sc != NULL) && (scene_member(rq->sc, dev) != NULL))
+      scene_member(rq->sc, dev)->sent = rq->sent;
+    *((end != NULL) ? &end->next : &dev->busy) = rq;
+    end = rq;
+    ++sent;
+    if (last)
+      break;
+  }
+
+  // next batch spaced by learned rate (requests left behind mean the link could take more)
+  dev->pace = now+sent*1000000LL/dev_rate(dev);
+  dev->limited |= (dev->rqhead != NULL);
+
+  // await confirmation (write commands of a batch whose confirmed write failed are done)
+  if ((end != NULL) && (end->req[0] == GATT_WRITE_REQ))
+    dev_state(dev, DEV_BUSY, (end->req[4] == 0x02) ? QUERY_TIMEOUT : RESP_TIMEOUT*1000);
+  else if (end != NULL)
+    complete(dev, NULL);
+}
+
+// process incoming packet (returns 1 once parm query complete, -1 if query segments inconsistent)
+int receive(struct device *dev, const uint8_t *rcvbuf, int rcvlen, FILE *fp)
+{
+  struct sp630e *sp = &dev->sp, *pr = &dev->pr;
+
+  // reassemble device config (segment index places data so loss/reorder/duplicates are harmless)
+  if ((rcvlen > 8) && (rcvbuf[0] == GATT_HAND_VAL_NOTIFY) && (rcvbuf[3] == 0x53) && (rcvbuf[4] == 0x02)) {
+    if (!dev->qs.active)
+      return 0;
+    METRIC_ADD(dev->met.notifies, 1);
+    int len = rcvbuf[8];
+    int rc = (9+len <= rcvlen) ? query_segment(dev, rcvbuf[7], rcvbuf+9, len) : -1;
+    if (rc <= 0)
+      return rc;
+    len = 77+dev->qs.buf[76]*2;
+    memset(sp, 0, sizeof(*sp));
+    memcpy(sp, dev->qs.buf, len);
+    query_reset(dev);
+
+    // show parms/changes after final query segment
+    char out[4096];
+    if (!dev->qs.cnt++)
+      memcpy(pr, (dev->sh->queried > 0) ? &dev->sh->qr : sp, sizeof(*pr));
+
+    const char *key[256] = { NULL } ;
+    for (int i = 0; format[i].fmt != NULL; ++i)
+      for (int j = 0; j < format[i].len; ++j)
+        key[format[i].off+j] = format[i].key;
+
+    // compare as bytes (u0 is only the first byte)
+    const uint8_t *pr8 = (const uint8_t *)pr, *sp8 = (const uint8_t *)sp;
+    len = 0;
+    for (int i = 0; i < sizeof(*sp); ++i)
+      if (pr8[i] != sp8[i]) {
+        if (key[i] != NULL)
+          len += snprintf(out+len, sizeof(out)-len, "(%s)", key[i]);
+        len += snprintf(out+len, sizeof(out)-len, "0x%02x:%02x->%02x ", i, pr8[i], sp8[i]);
+      }
+    if (len > 0)
+      fprintf(stderr, "diff: %s\n", out);
+
+    if (fp != NULL)
+      show(fp, sp, pr);
+    memcpy(pr, sp, sizeof(*pr));
+
+    // learned rate only holds for the firmware it was learned on
+    if (memcmp(dev->sh->fw, sp->fw, sizeof(sp->fw)) != 0) {
+      if (dev->sh->fw[0] != 0) {
+        fprintf(stderr, "%s fw %.8s: relearning rate\n", dev->addr, sp->fw);
+        dev->sh->rate = dev->sh->cwnd = 0;
+      }
+      memcpy(dev->sh->fw, sp->fw, sizeof(sp->fw));
+    }
+
+    // update shadow (fresh query replaces commands applied since the last one)
+    memcpy(&dev->sh->qr, sp, sizeof(*sp));
+    memcpy(&dev->sh->sp, sp, sizeof(*sp));
+    dev->sh->queried = dev->sh->updated = wall_ms();
+    return 1;
+  }
+  return 0;
+}
+
+// packet send/receive/close common to socket transports
+ssize_t sock_send(int sock, const void *buf, size_t len)
+{
+  return send(sock, buf, len, 0);
+}
+
+ssize_t sock_recv(int sock, void *buf, size_t len)
+{
+  return read(sock, buf, len);
+}
+
+void sock_close(int sock)
+{
+  close(sock);
+}
+
+#ifndef NO_BLUETOOTH
+// l2cap att channel to bluetooth le controller
+int l2cap_open(const char *bdaddr)
+{
+  int sock = socket(PF_BLUETOOTH, SOCK_SEQPACKET|SOCK_NONBLOCK, BTPROTO_L2CAP);
+  if (sock < 0) {
+    fprintf(stderr, "socket error: %s (%d)\n", strerror(errno), errno);
+    return -1;
+  }
+
+  // bluetooth requires binding prior to connect
+  struct sockaddr_l2 addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.l2_family = AF_BLUETOOTH;
+  addr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
+  addr.l2_cid = htobs(4);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    fprintf(stderr, "bind error: %s (%d)\n", strerror(errno), errno);
+
+  // connect at low security
+  struct bt_security sec;
+  memset(&sec, 0, sizeof(sec));
+  sec.level = BT_SECURITY_LOW;
+  if (setsockopt(sock, SOL_BLUETOOTH, BT_SECURITY, &sec, sizeof(sec)) < 0)
+    fprintf(stderr, "setsockopt error: %s (%d)\n", strerror(errno), errno);
+
+  // setup destination bluetooth address
+  memset(&addr, 0, sizeof(addr));
+  addr.l2_family = AF_BLUETOOTH;
+  addr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
+  addr.l2_cid = htobs(4);
+  str2ba(bdaddr, &addr.l2_bdaddr);
+  connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+  return sock;
+}
+
+static const struct transport _l2cap = { "l2cap", l2cap_open, sock_send, sock_recv, sock_close };
+#endif
+
+// unix seqpacket socket to emulated controller (see spe6emu)
+int unix_open(const char *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path+((strncmp(path, "unix:", 5) == 0) ? 5 : 0));
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_NONBLOCK, 0);
+  if ((sock >= 0) && (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) && (errno != EINPROGRESS)) {
+    fprintf(stderr, "connect error %s: %s (%d)\n", path, strerror(errno), errno);
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+static const struct transport _unix = { "unix", unix_open, sock_send, sock_recv, sock_close };
+
+// replay time a recorded response is due (recorded delay after the send it answers, scaled by speed)
+int64_t replay_due(struct rpdev *rd, struct trace_rec *rec)
+{
+  return rd->base+((_rp.speed > 0) ? (int64_t)((rec->t-rd->tbase)/_rp.speed) : 0);
+}
+
+// drop stand-in end of connection (recorded close, or spe6ctrl closed its end)
+void replay_hangup(struct rpdev *rd)
+{
+  if (rd->peer >= 0) {
+    epoll_ctl(_epfd, EPOLL_CTL_DEL, rd->peer, NULL);
+    close(rd->peer);
+  }
+  rd->peer = rd->pend = -1;
+}
+
+// return recorded responses (and close) following the answered send once due (all now if force)
+void replay_emit(struct rpdev *rd, int64_t now, int force)
+{
+  for (; rd->pend >= 0; ++rd->pend) {
+    struct trace_rec *rec = (rd->pend < rd->n) ? rd->rec[rd->pend] : NULL;
+    if ((rec == NULL) || ((rec->type != TR_RECV) && (rec->type != TR_CLOSE))) {
+      rd->cur = rd->pend;
+      rd->pend = -1;
+      return;
+    }
+    if (!force && (now < replay_due(rd, rec)))
+      return;
+    _rp.last = now;
+    if (rec->type == TR_CLOSE) {
+      rd->cur = rd->pend+1;
+      replay_hangup(rd);
+      return;
+    }
+    if (rd->peer >= 0)
+      write(rd->peer, rec+1, rec->len);
+  }
+}
+
+// connect to stand-in device (picks up at next recorded connect)
+int replay_open(const char *addr)
+{
+  struct rpdev *rd = NULL;
+  for (int i = 0; i < _rp.ndev; ++i)
+    if (strcmp(_rp.d[i].dev->addr, addr) == 0)
+      rd = &_rp.d[i];
+  if (rd == NULL)
+    return -1;
+  replay_hangup(rd);
+  for (; (rd->cur < rd->n) && (rd->rec[rd->cur]->type != TR_OPEN); ++rd->cur)
+    rd->skipped += (rd->rec[rd->cur]->type == TR_SEND);
+  int sv[2];
+  if ((rd->cur >= rd->n) || (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_NONBLOCK, 0, sv) < 0))
+    return -1;
+  struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EV_REPLAY|(rd-_rp.d) };
+  epoll_ctl(_epfd, EPOLL_CTL_ADD, rd->peer = sv[1], &ev);
+  rd->tbase = rd->rec[rd->cur]->t;
+  rd->pend = rd->cur+1;
+  _rp.last = rd->base = now_us();
+  return sv[0];
+}
+
+// send to stand-in device (matched against the next recorded sends, unmatched writes acknowledged)
+ssize_t replay_send(int sock, const void *buf, size_t len)
+{
+  struct rpdev *rd = NULL;
+  for (int i = 0; i < _rp.ndev; ++i)
+    if (_rp.d[i].dev->sock == sock)
+      rd = &_rp.d[i];
+  if ((rd == NULL) || (rd->peer < 0)) {
+    errno = EPIPE;
+    return -1;
+  }
+  int64_t now = now_us();
+  ++rd->sends;
+  _rp.last = now;
+  // responses not yet due are skipped over, search stops at end of recorded connection
+  int p = (rd->pend >= 0) ? rd->pend : rd->cur, j = p, k = p, seen = 0;
+  while ((j < rd->n) && (rd->rec[j]->type == TR_RECV))
+    ++j;
+  for (k = j; (k < rd->n) && (seen < TRACE_AHEAD) && (rd->rec[k]->type != TR_OPEN) && (rd->rec[k]->type != TR_CLOSE); ++k) {
+    if (rd->rec[k]->type != TR_SEND)
+      continue;
+    if ((rd->rec[k]->len == len) && (memcmp(rd->rec[k]+1, buf, len) == 0))
+      break;
+    ++seen;
+  }
+  if ((k >= rd->n) || (seen >= TRACE_AHEAD) || (rd->rec[k]->type != TR_SEND)) {
+    ++rd->unmatched;
+    if (_verbose)
+      fprintf(stderr, "replay %s: unmatched send(%d)\n", rd->dev->addr, (int)len);
+    if (((const uint8_t *)buf)[0] == GATT_WRITE_REQ)
+      write(rd->peer, (uint8_t[]){ GATT_WRITE_RSP }, 1);
+    return len;
+  }
+  // responses to earlier sends go out before the response to this one
+  if (k == j) {
+    rd->pend = p;
+    replay_emit(rd, now, 1);
+  } else
+    rd->skipped += seen;
+  ++rd->matched;
+  rd->tbase = rd->rec[k]->t;
+  rd->base = now;
+  rd->cur = k;
+  rd->pend = k+1;
+  return len;
+}
+
+static const struct transport _replay = { "replay", replay_open, replay_send, sock_recv, sock_close };
+
+// select transport from address form (unix:path or /path for emulator, otherwise bt-addr)
+const struct transport *transport(const char *addr)
+{
+  if (_rp.buf != NULL)
+    return &_replay;
+  if ((addr[0] == '/') || (strncmp(addr, "unix:", 5) == 0))
+    return &_unix;
+#ifndef NO_BLUETOOTH
+  return &_l2cap;
+#else
+  return NULL;
+#endif
+}
+
+// drop connection and schedule reconnect
+void dev_close(struct device *dev, int64_t delay)
+{
+  // drop of an established link means it was pushed too hard
+  if (dev->state >= DEV_READY) {
+    METRIC_ADD(dev->met.disconnects, 1);
+    dev_pace(dev, "disconnected");
+  } else if (dev->connstart > 0)
+    METRIC_ADD(dev->met.connfail, 1);
+  dev->rttmin = dev->pace = dev->connstart = 0;
+  if (dev->sock >= 0) {
+    trace_put(dev, TR_CLOSE, NULL, 0);
+    epoll_ctl(_epfd, EPOLL_CTL_DEL, dev->sock, NULL);
+    dev->tp->close(dev->sock);
+  }
+  // interrupted batch goes back to the head of the queue for replay after reconnect
+  // (an interrupted query keeps segments already received)
+  struct request *rq = dev->busy;
+  while ((rq != NULL) && (rq->next != NULL))
+    rq = rq->next;
+  if ((rq != NULL) && (((rq->req[4] == 0x02) ? ++dev->qs.tries : ++rq->tries) < REPLAY_MAX)) {
+    if ((rq->next = dev->rqhead) == NULL)
+      dev->rqtail = rq;
+    dev->rqhead = dev->busy;
+    dev->busy = NULL;
+  } else
+    query_reset(dev);
+  // not ready while the batch completes (complete() would otherwise return a dropped link to ready)
+  dev->state = DEV_DOWN;
+  complete(dev, "disconnected");
+  dev->sock = -1;
+
+  // first reconnect is immediate, repeated failures back off exponentially (with jitter)
+  int64_t wait = (dev->fails > 0) ? (int64_t)BACKOFF_BASE << ((dev->fails < 8) ? dev->fails-1 : 7) : 0;
+  if (wait > BACKOFF_MAX)
+    wait = BACKOFF_MAX;
+  wait += rand()%(wait/2+1);
+  ++dev->fails;
+  dev_state(dev, DEV_DOWN, (delay > wait) ? delay : wait);
+  dev->kind = NULL;
+  dev->mtu = ATT_DEFAULT_MTU;
+  memset(&dev->sp, 0, sizeof(dev->sp));
+  dev->qs.cnt = 0;
+}
+
+// start non-blocking connect (completion reported via epoll)
+void dev_connect(struct device *dev)
+{
+  int64_t conntime = (_lasttime > 0) ? _lasttime-now_ms() : CONN_TIMEOUT*1000;
+  if (conntime > CONN_TIMEOUT*1000)
+    conntime = CONN_TIMEOUT*1000;
+  fprintf(stderr, "connect %s (timeout=%d)\n", dev->addr, (int)(conntime/1000));
+  dev->connstart = now_us();
+  trace_put(dev, TR_OPEN, NULL, 0);
+  if ((dev->sock = dev->tp->open(dev->addr)) < 0) {
+    dev_close(dev, 0);
+    return;
+  }
+  struct epoll_event ev = { .events = EPOLLOUT, .data.u32 = EV_DEV|(dev-_dev) };
+  epoll_ctl(_epfd, EPOLL_CTL_ADD, dev->sock, &ev);
+  dev_state(dev, DEV_CONNECT, conntime);
+}
+
+// request larger att mtu (so wide query notifications fit a single pdu)
+void dev_mtu(struct device *dev)
+{
+  fprintf(stderr, "mtu %s %d\n", dev->addr, ATT_MAX_MTU);
+  uint8_t req[] = { GATT_MTU_REQ, ATT_MAX_MTU & 0xff, ATT_MAX_MTU >> 8 };
+  if (dev_send(dev, req, sizeof(req)) < 0) {
+    fprintf(stderr, "mtu error: %s (%d)\n", strerror(errno), errno);
+    dev_close(dev, 0);
+    return;
+  }
+  dev_state(dev, DEV_MTU, MTU_TIMEOUT);
+}
+
+// fail requests held too long while controller unreachable (or past their deadline)
+void dev_expire(struct device *dev)
+{
+  int64_t now = now_us();
+  for (struct request **pp = &dev->rqhead, *rq; (rq = *pp) != NULL; ) {
+    int late = (rq->deadline > 0) && (now > rq->deadline);
+    if (!late && ((dev->state >= DEV_READY) || (now-rq->queued <= HOLD_TIMEOUT*1000000LL))) {
+      dev->rqtail = rq;
+      pp = &rq->next;
+      continue;
+    }
+    *pp = rq->next;
+    if ((rq->req[4] == 0x02) && (dev->busy == NULL))
+      query_reset(dev);
+    dev->pq[rq->prio].expired += late;
+    respond(dev, rq, late ? "deadline" : "not connected");
+  }
+  if (dev->rqhead == NULL)
+    dev->rqtail = NULL;
+}
+
+// resume with cached fingerprint (notify enabled without waiting for confirmation)
+void dev_resume(struct device *dev)
+{
+  uint8_t req[] = { GATT_WRITE_CMD, SPE6_HANDLE_CCC, 0x00, 0x01, 0x00 };
+  int i = dev->sh->ident-1;
+  dev->kind = _ident[i].kind;
+  dev->safe = _ident[i].width;
+  fprintf(stderr, "resume %s as %s\n", dev->addr, dev->kind);
+  if (dev_send(dev, req, sizeof(req)) < 0)
+    dev_close(dev, 0);
+  else
+    dev_ready(dev);
+}
+
+// send identify (0x2902 descriptor read)
+void dev_identify(struct device *dev)
+{
+  fprintf(stderr, "identify %s 0x2902\n", dev->addr);
+  uint8_t req[] = { GATT_READ_BY_TYPE_REQ, 0x01, 0x00, 0xff, 0xff, 0x02, 0x29 };
+  if (dev_send(dev, req, sizeof(req)) < 0) {
+    fprintf(stderr, "identify error: %s (%d)\n", strerror(errno), errno);
+    dev_close(dev, 0);
+    return;
+  }
+  int retry = dev->retry;
+  dev_state(dev, DEV_IDENTIFY, IDENT_TIMEOUT);
+  dev->retry = retry+1;
+}
+
+// enable notify (unless fingerprint shows it already enabled)
+void dev_notify(struct device *dev, int enabled)
+{
+  uint8_t req[] = { GATT_WRITE_REQ, SPE6_HANDLE_CCC, 0x00, 0x01, 0x00 };
+  if (enabled)
+    dev_ready(dev);
+  else if (dev_send(dev, req, sizeof(req)) < 0)
+    dev_close(dev, 0);
+  else
+    dev_state(dev, DEV_NOTIFY, NOTIFY_TIMEOUT);
+}
+
+// handle socket activity for device
+void dev_event(struct device *dev, uint32_t events)
+{
+  // connect completed (or failed)
+  if (dev->state == DEV_CONNECT) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(dev->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (!(events & EPOLLOUT) || (err != 0)) {
+      fprintf(stderr, "connect error %s: %s (%d)\n", dev->addr, strerror(err), err);
+      dev_close(dev, 0);
+      return;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EV_DEV|(dev-_dev) };
+    epoll_ctl(_epfd, EPOLL_CTL_MOD, dev->sock, &ev);
+    // known controller without mtu exchange support goes straight to ready
+    if ((dev->sh->ident > 0) && (dev->sh->mtu == ATT_DEFAULT_MTU))
+      dev_resume(dev);
+    else
+      dev_mtu(dev);
+    return;
+  }
+
+  uint8_t rcvbuf[1024];
+  int rcvlen = dev->tp->recv(dev->sock, rcvbuf, sizeof(rcvbuf));
+  if ((rcvlen < 0) && (errno == EAGAIN))
+    return;
+  if (rcvlen > 0)
+    trace_put(dev, TR_RECV, rcvbuf, rcvlen);
+  if (rcvlen <= 0) {
+    fprintf(stderr, "read error %s: %s (%d)\n", dev->addr, strerror(errno), errno);
+    dev_close(dev, 0);
+    return;
+  }
+
+  // show meaningful packets (skip single byte response acknowledgements)
+  if (_verbose && ((rcvlen > 1) || (rcvbuf[0] != GATT_WRITE_RSP))) {
+    fprintf(stderr, "recv(%d):", rcvlen);
+    for (int i = 0; i < rcvlen; ++i)
+      fprintf(stderr, " %02x", rcvbuf[i]);
+    if ((rcvbuf[rcvlen-1] > ' ') && (rcvbuf[rcvlen-1] < 127))
+      fprintf(stderr, " (%c)", rcvbuf[rcvlen-1]);
+    fprintf(stderr, "\n");
+  }
+
+  // handle mtu response (error response means default mtu)
+  if (dev->state == DEV_MTU) {
+    if ((rcvlen >= 3) && (rcvbuf[0] == GATT_MTU_RSP)) {
+      int mtu = rcvbuf[1]|(rcvbuf[2] << 8);
+      dev->mtu = (mtu < ATT_DEFAULT_MTU) ? ATT_DEFAULT_MTU : (mtu > ATT_MAX_MTU) ? ATT_MAX_MTU : mtu;
+    }
+    if (((rcvlen >= 3) && (rcvbuf[0] == GATT_MTU_RSP)) || ((rcvlen >= 2) && (rcvbuf[0] == GATT_ERR_RSP) && (rcvbuf[1] == GATT_MTU_REQ))) {
+      fprintf(stderr, "mtu %s: %d\n", dev->addr, dev->mtu);
+      dev->sh->mtu = dev->mtu;
+      if (dev->sh->ident > 0)
+        dev_resume(dev);
+      else
+        dev_identify(dev);
+    }
+    return;
+  }
+
+  // handle identify response (unknown fingerprint retries on timeout)
+  if ((rcvlen > 4) && (rcvbuf[0] == GATT_READ_BY_TYPE_RSP) && (dev->state == DEV_IDENTIFY)) {
+    for (int i = 0; i < sizeof(_ident)/sizeof(_ident[0]); ++i) {
+      const uint8_t *resp = _ident[i].resp;
+      if ((rcvlen == resp[0]+4) && (memcmp(rcvbuf+4, resp+1, resp[0]) == 0)) {
+        dev->kind = _ident[i].kind;
+        dev->safe = _ident[i].width;
+        dev->sh->ident = i+1;
+        fprintf(stderr, "found %s at %s\n", dev->kind, dev->addr);
+        dev_notify(dev, resp[5] & 1);
+        break;
+      }
+    }
+    return;
+  }
+
+  // notify enabled
+  if ((dev->state == DEV_NOTIFY) && (rcvlen == 1) && (rcvbuf[0] == GATT_WRITE_RSP)) {
+    dev_ready(dev);
+    return;
+  }
+
+  // handle other receive (query output goes to requester)
+  FILE *fp = ((dev->busy != NULL) && dev->busy->quiet) ? NULL : ((dev->busy != NULL) && (dev->busy->cl != NULL)) ? dev->busy->cl->fp : stdout;
+  int done = receive(dev, rcvbuf, rcvlen, fp);
+
+  // match write response/error with outstanding batch (query completes after final segment)
+  if (dev->busy != NULL) {
+    if ((rcvlen >= 2) && (rcvbuf[0] == GATT_ERR_RSP) && (rcvbuf[1] == GATT_WRITE_REQ)) {
+      query_reset(dev);
+      METRIC_ADD(dev->met.errors, 1);
+      dev_pace(dev, "error response");
+      complete(dev, "error response");
+    } else if ((done < 0) && (dev->busy->req[4] == 0x02)) {
+      // corrupt segment (discard everything received as suspect)
+      memset(dev->qs.have, 0, sizeof(dev->qs.have));
+      if (!query_retry(dev))
+        complete(dev, "inconsistent query");
+    } else if ((dev->busy->req[4] == 0x02) ? done : ((rcvlen == 1) && (rcvbuf[0] == GATT_WRITE_RSP))) {
+      // remember widest query width delivered intact
+      if ((done > 0) && (dev->qs.width > dev->wok)) {
+        dev->wok = dev->qs.width;
+        if (dev->wbad <= dev->wok)
+          dev->wbad = 0;
+      }
+      complete(dev, NULL);
+    }
+  }
+}
+
+// handle state timeout (connect retry/timeout, identify/notify retry and response timeout)
+void dev_timeout(struct device *dev, int64_t now)
+{
+  if (now < dev->timer)
+    return;
+
+  switch (dev->state) {
+  case DEV_DOWN:
+    dev_connect(dev);
+    break;
+  case DEV_CONNECT:
+    fprintf(stderr, "connect error %s: timeout\n", dev->addr);
+    dev_close(dev, 0);
+    break;
+  case DEV_MTU:
+    // no exchange support (keep default mtu)
+    if (dev->sh->ident > 0)
+      dev_resume(dev);
+    else
+      dev_identify(dev);
+    break;
+  case DEV_IDENTIFY:
+    // can happen multiple times as sp630e goes unresponsive periodically
+    if (dev->retry < IDENT_RETRY) {
+      METRIC_ADD(dev->met.identretry, 1);
+      dev_identify(dev);
+    }
+    else
+      dev_close(dev, 0);
+    break;
+  case DEV_NOTIFY:
+    if (++dev->retry < IDENT_RETRY)
+      dev_notify(dev, 0);
+    else
+      dev_close(dev, 0);
+    break;
+  case DEV_READY:
+    // idle liveness probe (identify also re-enables notify if controller lost it)
+    dev_identify(dev);
+    break;
+  case DEV_BUSY:
+    // give up on unanswered request and confirm controller still responds
+    fprintf(stderr, "%s %s: timeout\n", dev->addr, _state[dev->state]);
+    if ((dev->busy != NULL) && (dev->busy->req[4] == 0x02) && query_retry(dev))
+      break;
+    query_reset(dev);
+    METRIC_ADD(dev->met.timeouts, 1);
+    dev_pace(dev, "timeout");
+    complete(dev, "timeout");
+    dev_identify(dev);
+    break;
+  }
+}
+
+// find device by address (optionally adding it)
+struct device *dev_find(const char *addr, int len, int add)
+{
+  for (int i = 0; i < _ndev; ++i)
+    if ((strlen(_dev[i].addr) == len) && (strncasecmp(_dev[i].addr, addr, len) == 0))
+      return &_dev[i];
+  if (!add || (_ndev >= MAX_DEVICE) || (len >= sizeof(_dev[0].addr)))
+    return NULL;
+  struct device *dev = &_dev[_ndev];
+  memset(dev, 0, sizeof(*dev));
+  snprintf(dev->addr, sizeof(dev->addr), "%.*s", len, addr);
+  if ((dev->tp = transport(dev->addr)) == NULL) {
+    fprintf(stderr, "%s: no transport (built without bluetooth)\n", dev->addr);
+    return NULL;
+  }
+  ++_ndev;
+  dev->sh = shadow_open(dev->addr);
+  trace_put(dev, TR_DEV, dev->addr, strlen(dev->addr));
+  trace_put(dev, TR_SHADOW, dev->sh, sizeof(*dev->sh));
+  dev->safe = _ident[0].width;
+  dev->mtu = ATT_DEFAULT_MTU;
+  dev->sock = -1;
+  dev->state = DEV_DOWN;
+  return dev;
+}
+
+// bt-addr format (xx:xx:xx:xx:xx:xx) or emulator socket (unix:path or /path)
+int isaddr(const char *addr, int len)
+{
+  if ((len > 0) && ((addr[0] == '/') || (strncmp(addr, "unix:", 5) == 0)))
+    return 1;
+  if (len != 17)
+    return 0;
+  for (int i = 2; i < len; i += 3)
+    if (addr[i] != ':')
+      return 0;
+  return 1;
+}
+
+// stage scene (scene <bt-addr>,<bt-addr>... <cmd> <parm1> ...), write fired once every device is idle
+void scene(struct client *cl, char *line)
+{
+  FILE *fp = (cl != NULL) ? cl->fp : stdout;
+  struct scene *sc = NULL, next = { .cl = cl, .start = now_us() };
+  for (int i = 0; (i < MAX_SCENE) && (sc == NULL); ++i)
+    if (_scene[i].n == 0)
+      sc = &_scene[i];
+  line += strspn(line, " \t=");
+  int len = strcspn(line, " \t");
+  char *cmd = line+len+strspn(line+len, " \t");
+  snprintf(next.name, sizeof(next.name), "%.*s", (int)strcspn(cmd, "\n\"\'= "), cmd);
+
+  // per-device write (any single command except queries)
+  const char *err = (sc == NULL) ? "too many scenes" : NULL;
+  for (char *addr = line, *end; (err == NULL) && (addr < line+len); addr = end+1) {
+    end = addr+strcspn(addr, ", \t");
+    struct device *dev = dev_find(addr, end-addr, isaddr(addr, end-addr));
+    if ((dev == NULL) || (scene_member(&next, dev) != NULL)) {
+      err = (dev == NULL) ? "unknown device" : NULL;
+      continue;
+    }
+    char buf[256];
+    struct request *rq = calloc(1, sizeof(*rq));
+    snprintf(buf, sizeof(buf), "%s", cmd);
+    next.m[next.n].rq = rq;
+    next.m[next.n++].dev = dev;
+    if (((rq->len = cmdline(dev, buf, rq->req, fp)) <= 0) || (rq->req[4] == 0x02))
+      err = "invalid command";
+    strcpy(rq->name, next.name);
+    rq->quiet = 1;
+  }
+  if ((err == NULL) && (next.n == 0))
+    err = "no devices";
+  if (err != NULL) {
+    for (int i = 0; i < next.n; ++i)
+      free(next.m[i].rq);
+    fprintf(fp, "err scene %s: %s\n", next.name, err);
+    fflush(fp);
+    return;
+  }
+  *sc = next;
+  sc->left = sc->n;
+  for (int i = 0; i < sc->n; ++i)
+    sc->m[i].rq->sc = sc;
+}
+
+// fire scene writes (planned once every device is idle or staging timed out)
+void scene_poll(void)
+{
+  int64_t now = now_us();
+  for (int s = 0; s < MAX_SCENE; ++s) {
+    struct scene *sc = &_scene[s];
+    if ((sc->n == 0) || (sc->left == 0))
+      continue;
+    if (!sc->fired) {
+      int idle = 1;
+      int64_t slow = 0;
+      for (int i = 0; i < sc->n; ++i) {
+        struct device *dev = sc->m[i].dev;
+        idle &= (dev->state == DEV_READY) && (dev->rqhead == NULL) && (dev->busy == NULL) && (dev->pace <= now);
+        slow = (dev->rtt > slow) ? dev->rtt : slow;
+      }
+      if (!idle && (now-sc->start < HOLD_TIMEOUT*1000000LL))
+        continue;
+      // faster links wait out half the rtt difference (one-way delay) so writes arrive together
+      for (int i = 0; i < sc->n; ++i) {
+        sc->m[i].rtt = sc->m[i].dev->rtt;
+        sc->m[i].at = now+(slow-sc->m[i].rtt)/2;
+      }
+      sc->fired = 1;
+    }
+    for (int i = 0; i < sc->n; ++i) {
+      struct device *dev = sc->m[i].dev;
+      struct request *rq = sc->m[i].rq;
+      if ((rq == NULL) || (sc->m[i].at > now))
+        continue;
+      sc->m[i].rq = NULL;
+      if (dev->state < DEV_READY) {
+        respond(dev, rq, "not connected");
+        continue;
+      }
+      // ahead of anything queued since planning
+      rq->queued = now;
+      rq->next = dev->rqhead;
+      dev->rqhead = rq;
+      if (dev->rqtail == NULL)
+        dev->rqtail = rq;
+      dispatch(dev);
+    }
+  }
+}
+
+// time of next planned scene write (ms, INT64_MAX=none)
+int64_t scene_next(void)
+{
+  int64_t next = INT64_MAX;
+  for (int s = 0; s < MAX_SCENE; ++s)
+    for (int i = 0; _scene[s].fired && (i < _scene[s].n); ++i)
+      if ((_scene[s].m[i].rq != NULL) && ((_scene[s].m[i].at+999)/1000 < next))
+        next = (_scene[s].m[i].at+999)/1000;
+  return next;
+}
+
+// load desired parms for reconcile round
+// (<bt-addr>[,<bt-addr>...] key=value ... per line, "*" line applies to every address, # comments)
+int reconcile_load(void)
+{
+  FILE *fp = fopen(_rc.file, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "reconcile %s: %s (%d)\n", _rc.file, strerror(errno), errno);
+    return -1;
+  }
+  struct plan all = { 0 };
+  char line[4096];
+  _rc.n = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char *addr = line+strspn(line, " \t");
+    int len = strcspn(addr, " \t\n");
+    struct plan pl = { 0 };
+    if ((*addr == '#') || (len == 0))
+      continue;
+    if (want(&pl, addr+len, stderr) < 0) {
+      fprintf(stderr, "reconcile %s: skipping %.*s\n", _rc.file, len, addr);
+      continue;
+    }
+    if ((len == 1) && (*addr == '*')) {
+      for (int i = 0; i < sizeof(pl.set); ++i)
+        if (pl.set[i])
+          ((uint8_t *)&all.sp)[i] = ((uint8_t *)&pl.sp)[i], all.set[i] = 1;
+      continue;
+    }
+    // addresses not otherwise in use stay disconnected between rounds
+    for (char *end; len > 0; len -= end-addr+1, addr = end+1) {
+      end = addr+strcspn(addr, ", \t\n");
+      struct device *dev = dev_find(addr, end-addr, 0);
+      if ((dev == NULL) && ((dev = dev_find(addr, end-addr, 1)) != NULL)) {
+        dev->park = 1;
+        dev_state(dev, DEV_DOWN, -1);
+      }
+      if (dev == NULL) {
+        fprintf(stderr, "reconcile %s: cannot add %.*s\n", _rc.file, (int)(end-addr), addr);
+        continue;
+      }
+      int i = 0;
+      while ((i < _rc.n) && (_rc.m[i].dev != dev))
+        ++i;
+      if (i == _rc.n) {
+        memset(&_rc.m[_rc.n++], 0, sizeof(_rc.m[0]));
+        _rc.m[i].dev = dev;
+      }
+      for (int j = 0; j < sizeof(pl.set); ++j)
+        if (pl.set[j])
+          ((uint8_t *)&_rc.m[i].want.sp)[j] = ((uint8_t *)&pl.sp)[j], _rc.m[i].want.set[j] = 1;
+    }
+  }
+  fclose(fp);
+  for (int i = 0; i < _rc.n; ++i)
+    for (int j = 0; j < sizeof(all.set); ++j)
+      if (all.set[j] && !_rc.m[i].want.set[j])
+        ((uint8_t *)&_rc.m[i].want.sp)[j] = ((uint8_t *)&all.sp)[j], _rc.m[i].want.set[j] = 1;
+  return _rc.n;
+}
+
+// report reconciled device (drift is desired fields that differed from the fresh query)
+void reconcile_done(struct rcdev *m)
+{
+  struct device *dev = m->dev;
+  const uint8_t *qr = (uint8_t *)&dev->sh->qr, *sp = (uint8_t *)&dev->sh->sp, *want = (uint8_t *)&m->want.sp;
+  char out[1024], was[16], now[16];
+  int len = 0, drift = 0, missed = 0;
+  for (int i = 0; format[i].fmt != NULL; ++i) {
+    int set = 0, diff = 0;
+    for (int j = 0; j < format[i].len; ++j) {
+      set |= m->want.set[format[i].off+j];
+      diff |= m->want.set[format[i].off+j] && (qr[format[i].off+j] != want[format[i].off+j]);
+      missed |= m->want.set[format[i].off+j] && (sp[format[i].off+j] != want[format[i].off+j]);
+    }
+    if (!set || !diff || (strchr(format[i].fmt, 's') != NULL))
+      continue;
+    const uint8_t *q = qr+format[i].off, *w = want+format[i].off;
+    snprintf(was, sizeof(was), format[i].fmt, q[0], q[1], q[2], q[3]);
+    snprintf(now, sizeof(now), format[i].fmt, w[0], w[1], w[2], w[3]);
+    len += snprintf(out+len, sizeof(out)-len, " %s=%s->%s", format[i].key, was, now);
+    ++drift;
+  }
+  if (dev->sh->queried < m->start) {
+    fprintf(stdout, "err reconcile %s: %s\n", dev->addr, (dev->state < DEV_READY) ? "not connected" : "query failed");
+    ++_rc.failed;
+  } else if (missed) {
+    fprintf(stdout, "err reconcile %s: not applied%s\n", dev->addr, out);
+    ++_rc.failed;
+  } else {
+    fprintf(stdout, "ok reconcile %s drift=%d%s\n", dev->addr, drift, (len > 0) ? out : "");
+    _rc.drifted += (drift > 0);
+  }
+  fflush(stdout);
+  m->state = RC_DONE;
+  if (dev->park) {
+    dev_close(dev, 0);
+    dev->fails = 0;
+    dev_state(dev, DEV_DOWN, -1);
+  }
+}
+
+// run reconcile round (query then push drift, at most --reconcile max devices at once)
+void reconcile_poll(void)
+{
+  if ((_rc.n == 0) && ((_rc.next == 0) || (now_ms() < _rc.next)))
+    return;
+  if ((_rc.n == 0) && (reconcile_load() <= 0)) {
+    _rc.next = (_rc.interval > 0) ? now_ms()+_rc.interval*1000LL : 0;
+    return;
+  }
+  if (_rc.start == 0) {
+    _rc.start = now_us();
+    _rc.next = 0;
+    _rc.drifted = _rc.failed = 0;
+  }
+
+  int active = 0, left = 0;
+  for (int i = 0; i < _rc.n; ++i) {
+    struct device *dev = _rc.m[i].dev;
+    if ((_rc.m[i].state == RC_ACTIVE) && (dev->rqhead == NULL) && (dev->busy == NULL))
+      reconcile_done(&_rc.m[i]);
+    active += (_rc.m[i].state == RC_ACTIVE);
+    left += (_rc.m[i].state != RC_DONE);
+  }
+  for (int i = 0; (i < _rc.n) && (active < _rc.limit); ++i) {
+    struct rcdev *m = &_rc.m[i];
+    if (m->state != RC_WAIT)
+      continue;
+    // fresh query (drift is measured against the controller, not the cache), then only what differs
+    struct request *qr = calloc(1, sizeof(*qr)), *rq = calloc(1, sizeof(*rq));
+    char buf[32] = "query";
+    strcpy(qr->name, "query");
+    qr->quiet = 1;
+    qr->len = cmdline(m->dev, buf, qr->req, stdout);
+    strcpy(rq->name, "reconcile");
+    rq->quiet = 1;
+    qr->prio = rq->prio = PRIO_BACKGROUND;
+    rq->plan = malloc(sizeof(*rq->plan));
+    memcpy(rq->plan, &m->want, sizeof(m->want));
+    if (dev_parked(m->dev))
+      dev_state(m->dev, DEV_DOWN, 0);
+    append(m->dev, qr);
+    append(m->dev, rq);
+    m->start = wall_ms();
+    m->state = RC_ACTIVE;
+    ++active;
+  }
+  if (left > 0)
+    return;
+
+  fprintf(stdout, "reconcile devices=%d drifted=%d failed=%d elapsed=%lldms\n", _rc.n, _rc.drifted, _rc.failed,
+      (long long)(now_us()-_rc.start)/1000);
+  fflush(stdout);
+  _rc.n = 0;
+  _rc.start = 0;
+  _rc.next = (_rc.interval > 0) ? now_ms()+_rc.interval*1000LL : 0;
+}
+
+// route request line ([bt-addr] cmd <arg1> ... <argn>) to device(s)
+// (request without bt-addr goes to every device)
+void route(struct client *cl, char *line, int add)
+{
+  line += strspn(line, " \t\r");
+  trace_put(NULL, TR_REQ, line, strcspn(line, "\n"));
+  int n = strcspn(line, " \t\r");
+  struct device *dev = dev_find(line, n, add && isaddr(line, n));
+  if ((dev == NULL) && isaddr(line, n)) {
+    if (cl != NULL) {
+      fprintf(cl->fp, "err %.*s: unknown device\n", n, line);
+      fflush(cl->fp);
+    }
+    return;
+  }
+  if (dev != NULL)
+    line += n+strspn(line+n, " \t\r");
+  if ((line[0] == '-') && (line[1] == '-'))
+    line += 2;
+  if (line[0] < ' ')
+    return;
+  if ((dev == NULL) && (strncmp(line, "scene", 5) == 0) && ((line[5] == ' ') || (line[5] == '='))) {
+    scene(cl, line+5);
+    return;
+  }
+  // metrics (every device unless addressed) and hex dump switch apply to the process
+  FILE *fp = (cl != NULL) ? cl->fp : stdout;
+  if ((strncmp(line, "metrics", 7) == 0) && ((unsigned char)line[7] <= ' ')) {
+    metrics_show(fp, dev);
+    fprintf(fp, "ok metrics\n");
+    fflush(fp);
+    return;
+  }
+  if ((strncmp(line, "verbose", 7) == 0) && (((unsigned char)line[7] <= ' ') || (line[7] == '='))) {
+    _verbose = ((line[7] != 0) && (line[8] != 0)) ? atoi(line+8) : !_verbose;
+    fprintf(fp, "ok verbose %d\n", _verbose);
+    fflush(fp);
+    return;
+  }
+  for (int i = 0; i < _ndev; ++i)
+    if ((dev == NULL) || (dev == &_dev[i]))
+      enqueue(&_dev[i], cl, line);
+}
+
+// load trace for replay (devices created with recorded shadows, records split per device)
+int replay_load(const char *spec)
+{
+  // path[,speed]
+  char *opt = strchr(_rp.path = spec, ',');
+  _rp.speed = 1;
+  if (opt != NULL) {
+    *opt = 0;
+    _rp.speed = atof(opt+1);
+  }
+  struct stat st;
+  struct trace_hdr *hdr = NULL;
+  int fd = open(_rp.path, O_RDONLY);
+  if ((fd < 0) || (fstat(fd, &st) < 0) || (st.st_size < sizeof(*hdr)) || ((_rp.buf = malloc(st.st_size)) == NULL) ||
+      (read(fd, _rp.buf, st.st_size) != st.st_size)) {
+    fprintf(stderr, "%s: %s (%d)\n", _rp.path, strerror(errno), errno);
+    return -1;
+  }
+  close(fd);
+  hdr = (struct trace_hdr *)_rp.buf;
+  if ((hdr->magic != TRACE_MAGIC) || (hdr->version != 1)) {
+    fprintf(stderr, "%s: not a trace\n", _rp.path);
+    return -1;
+  }
+
+  // recorded cache timestamps shift to now (so cached parms are as fresh as when recorded)
+  int64_t shift = wall_ms()-hdr->wall;
+  for (int pass = 0; pass < 2; ++pass) {
+    struct trace_rec *rec;
+    for (size_t off = sizeof(*hdr); off+sizeof(*rec) <= st.st_size; off += sizeof(*rec)+rec->len) {
+      rec = (struct trace_rec *)(_rp.buf+off);
+      if (off+sizeof(*rec)+rec->len > st.st_size)
+        break;
+      struct device *dev = (rec->dev < 0xff) ? _rp.trdev[rec->dev] : NULL;
+      struct rpdev *rd = NULL;
+      for (int i = 0; (dev != NULL) && (i < _rp.ndev); ++i)
+        if (_rp.d[i].dev == dev)
+          rd = &_rp.d[i];
+      _rp.span = rec->t;
+      if (rec->type == TR_REQ) {
+        if (pass)
+          _rp.rq[_rp.nreq] = rec;
+        ++_rp.nreq;
+      } else if (rec->type == TR_DEV) {
+        if (pass || (rec->dev == 0xff) || ((dev = dev_find((char *)(rec+1), rec->len, 1)) == NULL))
+          continue;
+        _rp.trdev[rec->dev] = dev;
+        for (int i = 0; i < _rp.ndev; ++i)
+          if (_rp.d[i].dev == dev)
+            rd = &_rp.d[i];
+        if ((rd == NULL) && (_rp.ndev < MAX_DEVICE)) {
+          rd = &_rp.d[_rp.ndev++];
+          rd->dev = dev;
+          rd->peer = rd->pend = -1;
+        }
+      } else if (rec->type == TR_SHADOW) {
+        if (pass || (dev == NULL) || (rec->len != sizeof(*dev->sh)))
+          continue;
+        memcpy(dev->sh, rec+1, sizeof(*dev->sh));
+        if (dev->sh->queried > 0)
+          dev->sh->queried += shift;
+        if (dev->sh->updated > 0)
+          dev->sh->updated += shift;
+      } else if (rd != NULL) {
+        if (pass)
+          rd->rec[rd->n] = rec;
+        ++rd->n;
+      }
+    }
+    if (pass)
+      break;
+    // second pass fills per-device record lists sized by the first
+    if ((_rp.rq = calloc(_rp.nreq+1, sizeof(*_rp.rq))) == NULL)
+      exit(EXIT_FAILURE);
+    _rp.nreq = 0;
+    for (int i = 0; i < _rp.ndev; ++i) {
+      if ((_rp.d[i].rec = calloc(_rp.d[i].n+1, sizeof(*_rp.d[i].rec))) == NULL)
+        exit(EXIT_FAILURE);
+      _rp.d[i].n = 0;
+    }
+  }
+  fprintf(stderr, "replay %s devices=%d requests=%d recorded=%lldms speed=%g\n", _rp.path, _rp.ndev, _rp.nreq, (long long)(_rp.span/1000), _rp.speed);
+  _rp.start = _rp.last = now_us();
+  return 0;
+}
+
+// reissue recorded requests and return recorded responses once due
+void replay_poll(void)
+{
+  if (_rp.buf == NULL)
+    return;
+  int64_t now = now_us();
+  for (; (_rp.req < _rp.nreq) && ((_rp.speed <= 0) || (now >= _rp.start+(int64_t)(_rp.rq[_rp.req]->t/_rp.speed))); ++_rp.req) {
+    struct trace_rec *rec = _rp.rq[_rp.req];
+    char line[4096];
+    snprintf(line, sizeof(line), "%.*s", rec->len, (char *)(rec+1));
+    if (rec->dev == 0xff)
+      route(NULL, line, 1);
+    else if (_rp.trdev[rec->dev] != NULL)
+      enqueue(_rp.trdev[rec->dev], NULL, line);
+    _rp.last = now;
+  }
+  for (int i = 0; i < _rp.ndev; ++i)
+    replay_emit(&_rp.d[i], now, 0);
+}
+
+// next recorded request or response due (ms)
+int64_t replay_next(void)
+{
+  int64_t next = INT64_MAX;
+  if ((_rp.buf != NULL) && (_rp.req < _rp.nreq))
+    next = _rp.start+((_rp.speed > 0) ? (int64_t)(_rp.rq[_rp.req]->t/_rp.speed) : 0);
+  for (int i = 0; (_rp.buf != NULL) && (i < _rp.ndev); ++i) {
+    struct rpdev *rd = &_rp.d[i];
+    if ((rd->pend >= 0) && (rd->pend < rd->n) && (replay_due(rd, rd->rec[rd->pend]) < next))
+      next = replay_due(rd, rd->rec[rd->pend]);
+  }
+  return (next < INT64_MAX) ? (next+999)/1000 : next;
+}
+
+// stand-in end readable (only ever a hangup, sends are taken by replay_send)
+void replay_event(int idx)
+{
+  uint8_t buf[16];
+  ssize_t len = read(_rp.d[idx].peer, buf, sizeof(buf));
+  if ((len == 0) || ((len < 0) && (errno != EAGAIN)))
+    replay_hangup(&_rp.d[idx]);
+}
+
+// records left to replay (gives up on sends spe6ctrl never makes after HOLD_TIMEOUT without progress)
+int replay_active(void)
+{
+  if (_rp.buf == NULL)
+    return 0;
+  int active = (_rp.req < _rp.nreq);
+  for (int i = 0; i < _rp.ndev; ++i)
+    active |= (_rp.d[i].pend >= 0) || (_rp.d[i].cur < _rp.d[i].n);
+  return active && (now_us()-_rp.last < HOLD_TIMEOUT*1000000LL);
+}
+
+void replay_stats(FILE *fp)
+{
+  for (int i = 0; i < _rp.ndev; ++i) {
+    struct rpdev *rd = &_rp.d[i];
+    fprintf(fp, "replay %s sends=%lld matched=%lld skipped=%lld unmatched=%lld left=%d\n", rd->dev->addr, (long long)rd->sends,
+      (long long)rd->matched, (long long)rd->skipped, (long long)rd->unmatched, rd->n-rd->cur);
+  }
+  fprintf(fp, "replay elapsed=%lldms recorded=%lldms speed=%g\n", (long long)((now_us()-_rp.start)/1000), (long long)(_rp.span/1000), _rp.speed);
+}
+
+// accept daemon client connection
+void accept_client(int lsock)
+{
+  int fd = accept(lsock, NULL, NULL);
+  if (fd < 0)
+    return;
+  for (int i = 0; i < MAX_CLIENT; ++i) {
+    if (_cl[i].fd < 0) {
+      _cl[i].fd = fd;
+      _cl[i].fp = fdopen(dup(fd), "w");
+      _cl[i].len = 0;
+      struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EV_CLIENT|i };
+      epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev);
+      return;
+    }
+  }
+  fprintf(stderr, "daemon: too many clients\n");
+  close(fd);
+}
+
+// close daemon client (pending requests complete silently)
+void close_client(struct client *cl)
+{
+  for (int i = 0; i < _ndev; ++i) {
+    for (struct request *rq = _dev[i].rqhead; rq != NULL; rq = rq->next)
+      if (rq->cl == cl)
+        rq->cl = NULL;
+    if ((_dev[i].busy != NULL) && (_dev[i].busy->cl == cl))
+      _dev[i].busy->cl = NULL;
+  }
+  // scenes still staged or in flight report to stdout instead
+  for (int i = 0; i < MAX_SCENE; ++i)
+    if (_scene[i].cl == cl)
+      _scene[i].cl = NULL;
+  epoll_ctl(_epfd, EPOLL_CTL_DEL, cl->fd, NULL);
+  fclose(cl->fp);
+  close(cl->fd);
+  cl->fd = -1;
+}
+
+// process daemon client requests (one per line: [bt-addr] cmd <arg1> ... <argn>)
+void read_client(struct client *cl)
+{
+  int rc = read(cl->fd, cl->buf+cl->len, sizeof(cl->buf)-cl->len-1);
+  if (rc <= 0) {
+    close_client(cl);
+    return;
+  }
+  cl->len += rc;
+  cl->buf[cl->len] = 0;
+
+  char *line = cl->buf, *end;
+  while ((end = strchr(line, '\n')) != NULL) {
+    *end = 0;
+    route(cl, line, 1);
+    line = end+1;
+  }
+  if ((cl->len -= line-cl->buf) >= sizeof(cl->buf)-1)
+    cl->len = 0;
+  memmove(cl->buf, line, cl->len);
+}
+
+// run one pass of the event loop (returns 1 once every device is idle)
+int loop(void)
+{
+  // send requests queued outside the loop (or published to the ring) before waiting
+  int64_t now = now_ms(), next = now+1000;
+  ring_poll(0);
+  replay_poll();
+  for (int i = 0; i < _ndev; ++i)
+    dispatch(&_dev[i]);
+
+  // wait for device activity (or console input during interactive mode or daemon requests)
+  for (int i = 0; i < _ndev; ++i) {
+    if (_dev[i].timer < next)
+      next = _dev[i].timer;
+    if ((_dev[i].state == DEV_READY) && (_dev[i].rqhead != NULL) && ((_dev[i].pace+999)/1000 < next))
+      next = (_dev[i].pace+999)/1000;
+  }
+  if (scene_next() < next)
+    next = scene_next();
+  if ((_rc.next > 0) && (_rc.next < next))
+    next = _rc.next;
+  if (replay_next() < next)
+    next = replay_next();
+  static int64_t metricsnext = 0;
+  if ((_metrics != NULL) && (now >= metricsnext)) {
+    metrics_file();
+    metricsnext = now+_metricsint*1000LL;
+  }
+  if ((_metrics != NULL) && (metricsnext < next))
+    next = metricsnext;
+  struct epoll_event ev[32];
+  int n = epoll_wait(_epfd, ev, sizeof(ev)/sizeof(ev[0]), (next > now) ? next-now : 0);
+  if ((n < 0) && (errno != EINTR))
+    fprintf(stderr, "poll error: %s (%d)\n", strerror(errno), errno);
+
+  for (int i = 0; i < n; ++i) {
+    int idx = ev[i].data.u32 & 0xffff;
+    switch (ev[i].data.u32 & ~0xffff) {
+    case EV_DEV:
+      dev_event(&_dev[idx], ev[i].events);
+      break;
+    case EV_CLIENT:
+      if (_cl[idx].fd >= 0)
+        read_client(&_cl[idx]);
+      break;
+    case EV_LISTEN:
+      accept_client(idx);
+      break;
+    case EV_ANIM:
+      anim_tick();
+      break;
+    case EV_AUDIO:
+      audio_read(idx);
+      break;
+    case EV_VIDEO:
+      video_read(idx);
+      break;
+    case EV_RING:
+      ring_poll(1);
+      break;
+    case EV_REPLAY:
+      replay_event(idx);
+      break;
+    case EV_TTY: {
+      // process interactive console
+      char line[256];
+      if (fgets(line, sizeof(line), stdin) != NULL)
+        route(NULL, line, 0);
+      break;
+    }
+    }
+  }
+
+  // run device timers and send next request on idle devices
+  now = now_ms();
+  int done = 1;
+  for (int i = 0; i < _ndev; ++i) {
+    dev_timeout(&_dev[i], now);
+    dev_expire(&_dev[i]);
+    dispatch(&_dev[i]);
+    done &= (_dev[i].rqhead == NULL) && ((_dev[i].state == DEV_READY) || dev_parked(&_dev[i]));
+  }
+  scene_poll();
+  reconcile_poll();
+  replay_poll();
+  done &= !replay_active();
+  done &= (_rc.n == 0) && (_rc.next == 0);
+  for (int i = 0; i < MAX_SCENE; ++i)
+    done &= (_scene[i].n == 0);
+  return done;
+}
+
+// benchmark sample set (reported as p50/p99/max json)
+struct samples {
+  int cnt;
+  int64_t val[4096];
+};
+
+int cmp64(const void *a, const void *b)
+{
+  return (*(int64_t *)a > *(int64_t *)b) - (*(int64_t *)a < *(int64_t *)b);
+}
+
+void report(const char *name, struct samples *smp, const char *extra)
+{
+  if (smp->cnt == 0) {
+    printf("{\"metric\":\"%s\",\"n\":0%s}\n", name, extra);
+    return;
+  }
+  qsort(smp->val, smp->cnt, sizeof(smp->val[0]), cmp64);
+  printf("{\"metric\":\"%s\",\"unit\":\"us\",\"n\":%d,\"p50\":%lld,\"p99\":%lld,\"max\":%lld%s}\n", name, smp->cnt,
+      (long long)smp->val[smp->cnt/2], (long long)smp->val[(smp->cnt*99)/100], (long long)smp->val[smp->cnt-1], extra);
+  fflush(stdout);
+}
+
+// run event loop until device idle (returns elapsed us or -1 on timeout)
+int64_t settle(struct device *dev, int64_t timeout)
+{
+  int64_t start = now_us();
+  while ((dev->state != DEV_READY) || (dev->rqhead != NULL)) {
+    if (now_us()-start > timeout*1000)
+      return -1;
+    loop();
+  }
+  return now_us()-start;
+}
+
+// benchmark hot paths against a (typically emulated) controller
+int bench(struct device *dev, int iter)
+{
+  static struct samples smp;
+  struct client sink = { .fd = -1, .fp = fopen("/dev/null", "w") };
+  char extra[64], line[64];
+  if (iter > sizeof(smp.val)/sizeof(smp.val[0]))
+    iter = sizeof(smp.val)/sizeof(smp.val[0]);
+  if (settle(dev, CONN_TIMEOUT*1000) < 0) {
+    fprintf(stderr, "bench: %s not ready\n", dev->addr);
+    return EXIT_FAILURE;
+  }
+
+  // connect-to-ready
+  smp.cnt = 0;
+  for (int i = 0; i < iter/10+1; ++i) {
+    dev_close(dev, 0);
+    int64_t t = settle(dev, CONN_TIMEOUT*1000);
+    if (t >= 0)
+      smp.val[smp.cnt++] = t;
+  }
+  report("connect_ready", &smp, "");
+
+  // write request to write response
+  smp.cnt = 0;
+  for (int i = 0; i < iter; ++i) {
+    snprintf(line, sizeof(line), "speed %d", 1+i%10);
+    enqueue(dev, NULL, line);
+    if (settle(dev, RESP_TIMEOUT*1000) >= 0)
+      smp.val[smp.cnt++] = dev->rtt;
+  }
+  report("write_rsp", &smp, "");
+
+  // parm query reassembly at each notification width
+  const int width[] = { 14, 19, 29, 39, 49, 56, 66, 86, 106 };
+  for (int w = 0; w < sizeof(width)/sizeof(width[0]); ++w) {
+    // (widths the link cannot deliver intact time out, so stop at first failure)
+    int fail = 0;
+    smp.cnt = 0;
+    for (int i = 0; (i < iter/10+1) && !fail; ++i) {
+      snprintf(line, sizeof(line), "query %d", width[w]);
+      enqueue(dev, &sink, line);
+      if ((settle(dev, RESP_TIMEOUT*1000) >= 0) && (dev->rtt > 0))
+        smp.val[smp.cnt++] = dev->rtt;
+      else
+        ++fail;
+      dev->rtt = 0;
+    }
+    snprintf(extra, sizeof(extra), ",\"width\":%d,\"failed\":%d", width[w], fail);
+    report("query", &smp, extra);
+  }
+
+  // parm query at negotiated/learned width
+  smp.cnt = 0;
+  for (int i = 0; i < iter/10+1; ++i) {
+    enqueue(dev, &sink, "query");
+    if ((settle(dev, RESP_TIMEOUT*1000) >= 0) && (dev->rtt > 0))
+      smp.val[smp.cnt++] = dev->rtt;
+    dev->rtt = 0;
+  }
+  snprintf(extra, sizeof(extra), ",\"width\":%d,\"mtu\":%d", dev_width(dev), dev->mtu);
+  report("query_auto", &smp, extra);
+
+  // sustained set/rgb throughput (each command queued once the previous one left the queue, since a
+  // queued burst collapses to its last value, and rated by writes actually sent)
+  const char *burst[] = { "set %d", "rgb %d 0 0 255" };
+  for (int b = 0; b < sizeof(burst)/sizeof(burst[0]); ++b) {
+    int64_t start = now_us(), sent = dev->pq[PRIO_INTERACTIVE].sent, t = 0;
+    for (int i = 0; (i < iter) && (t >= 0); ++i) {
+      snprintf(line, sizeof(line), burst[b], i%256);
+      enqueue(dev, NULL, line);
+      for (int64_t at = now_us(); (dev->rqhead != NULL) && (t >= 0); loop())
+        t = (now_us()-at > RESP_TIMEOUT*1000000LL) ? -1 : 0;
+    }
+    if (t >= 0)
+      t = settle(dev, iter*RESP_TIMEOUT*1000LL);
+    sent = dev->pq[PRIO_INTERACTIVE].sent-sent;
+    snprintf(extra, sizeof(extra), ",\"cmds_per_sec\":%.1f,\"queued\":%d,\"sent\":%lld", (t > 0) ? sent*1e6/(now_us()-start) : 0.0,
+      iter, (long long)sent);
+    smp.cnt = 0;
+    report((b == 0) ? "burst_set" : "burst_rgb", &smp, extra);
+  }
+
+  // per-command submit cost of text parsing versus binary ring slots (queue coalesces, so no link time)
+  static struct spe6_ring *ring;
+  if ((ring = _ring.r) == NULL) {
+    ring = calloc(1, sizeof(*ring)+RING_SLOTS*sizeof(ring->slot[0]));
+    ring->slots = RING_SLOTS;
+    _ring.r = ring;
+  }
+  int64_t start = now_us();
+  for (int i = 0; i < iter; ++i) {
+    snprintf(line, sizeof(line), "rgb %d 0 0 255", i%256);
+    enqueue(dev, NULL, line);
+  }
+  int64_t text = now_us()-start;
+  settle(dev, RESP_TIMEOUT*1000);
+  start = now_us();
+  for (int i = 0; i < iter; ++i) {
+    uint8_t parm[] = { i%256, 0, 0, 255 };
+    if (spe6_ring_put(ring, dev-_dev, 0, 0, 0x52, parm, sizeof(parm)) < 0) {
+      ring_poll(0);
+      spe6_ring_put(ring, dev-_dev, 0, 0, 0x52, parm, sizeof(parm));
+    }
+  }
+  ring_poll(0);
+  snprintf(extra, sizeof(extra), ",\"text_ns\":%.0f,\"ring_ns\":%.0f", text*1e3/iter, (now_us()-start)*1e3/iter);
+  settle(dev, RESP_TIMEOUT*1000);
+  smp.cnt = 0;
+  report("submit", &smp, extra);
+
+  // recovery after injected disconnect (emulator command 0xfe) until next command completes
+  smp.cnt = 0;
+  for (int i = 0; i < iter/10+1; ++i) {
+    enqueue(dev, NULL, "#0xfe 0");
+    settle(dev, RESP_TIMEOUT*1000);
+    int64_t start = now_us();
+    while ((dev->state >= DEV_READY) && (now_us()-start < RESP_TIMEOUT*1000000LL))
+      loop();
+    enqueue(dev, NULL, "speed 5");
+    if (settle(dev, CONN_TIMEOUT*1000) >= 0)
+      smp.val[smp.cnt++] = now_us()-start;
+  }
+  report("recovery", &smp, "");
+
+  // audio analysis per hop (has to stay well under the hop time to keep up with live input)
+  static struct audio au = { .rate = 44100 };
+  uint8_t level[AUDIO_BANDS];
+  audio_init(&au);
+  smp.cnt = 0;
+  for (int i = 0; i < iter; ++i) {
+    for (int j = 0; j < AUDIO_FFT; ++j)
+      au.win[j] = (rand()%2001-1000)/1000.0f;
+    int64_t start = now_us();
+    audio_analyze(&au, level);
+    smp.val[smp.cnt++] = now_us()-start;
+  }
+  snprintf(extra, sizeof(extra), ",\"hop_us\":%d", AUDIO_HOP*1000000/au.rate);
+  report("audio_analyze", &smp, extra);
+
+  // video reduction of a 1080p rgb24 frame (30fps leaves 33ms per frame)
+  static struct video vid = { .w = 1920, .h = 1080, .gamma = 2.2, .wb = { 255, 255, 255 } };
+  static uint8_t row[1920*3];
+  for (int i = 0; i < sizeof(row); ++i)
+    row[i] = rand();
+  video_init(&vid);
+  smp.cnt = 0;
+  for (int i = 0; i < iter/10+1; ++i) {
+    int64_t start = now_us();
+    for (vid.row = 0; vid.row < vid.h; ++vid.row)
+      video_row(&vid, row);
+    video_frame(&vid);
+    smp.val[smp.cnt++] = now_us()-start;
+  }
+  snprintf(extra, sizeof(extra), ",\"simd\":\"%s\",\"size\":\"1920x1080\"", vid.simd);
+  report("video_reduce", &smp, extra);
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s bt-addr[,bt-addr...] [timeout] [--cmd=\"parm(s)\"] [--cmd=\"parm(s)\"] ... [-I(nteractive)] [--daemon=socket-path] [--pipeline[=window]] [--cache=dir] [--stale=seconds] [--probe=seconds] [--fps=rate] [--audio=pcm|wav[,rate[,channels]]] [--audio-rgb] [--video=raw,<w>x<h>[,rgb24|yuv420p][,region:...]] [--video-cal=gamma[,r:g:b]] [--scene=\"bt-addr,bt-addr... cmd parm(s)\"] [--reconcile=file[,interval[,max]]] [--ring=path[,slots]] [--metrics=path[,seconds]] [--trace=path] [--replay=path[,speed]] [-v(erbose)] [--bench[=iterations]]\n", argv[0]);
+    for (int i = 0; cmdlist[i].cmd[0] != 0; ++i) {
+      char cmd[256];
+      snprintf(cmd, sizeof(cmd), "  --%s=\"%s\"", cmdlist[i].cmd, cmdlist[i].parm);
+      fprintf(stderr, "%-40s  %s\n", cmd, cmdlist[i].help);
+      //fprintf(stderr, "  --%s=\"%s\" (%s)\n", cmdlist[i].cmd, cmdlist[i].parm, cmdlist[i].help);
+    }
+    exit(0);
+  }
+
+  srand(time(NULL)^getpid());
+
+  // options applying to every device (pipelined writes, parm cache)
+  for (int i = 2; i < argc; ++i) {
+    if (strncmp(argv[i], "--pipeline", 10) == 0)
+      _window = (argv[i][10] == '=') ? atoi(argv[i]+11) : 4;
+    if (strncmp(argv[i], "--cache=", 8) == 0)
+      _cache = (argv[i][8] != 0) ? argv[i]+8 : NULL;
+    if (strncmp(argv[i], "--stale=", 8) == 0)
+      _stale = atoi(argv[i]+8);
+    if (strncmp(argv[i], "--probe=", 8) == 0)
+      _probe = atoi(argv[i]+8);
+    if (strncmp(argv[i], "--fps=", 6) == 0)
+      _fps = atoi(argv[i]+6);
+    if (strcmp(argv[i], "--audio-rgb") == 0)
+      _au.rgb = 1;
+    if (strcmp(argv[i], "-v") == 0)
+      _verbose = 1;
+    if (strncmp(argv[i], "--metrics=", 10) == 0) {
+      // path[,seconds]
+      char *opt = strchr(_metrics = argv[i]+10, ',');
+      if (opt != NULL) {
+        *opt = 0;
+        _metricsint = (atoi(opt+1) > 0) ? atoi(opt+1) : 1;
+      }
+    }
+    if (strncmp(argv[i], "--reconcile=", 12) == 0) {
+      // file[,interval[,max]]
+      char *opt = strchr(_rc.file = argv[i]+12, ',');
+      if (opt != NULL) {
+        *opt++ = 0;
+        _rc.interval = atoi(opt);
+        if ((opt = strchr(opt, ',')) != NULL)
+          _rc.limit = (atoi(opt+1) > 0) ? atoi(opt+1) : 1;
+      }
+      _rc.next = 1;
+    }
+    if (strncmp(argv[i], "--video-cal=", 12) == 0)
+      sscanf(argv[i]+12, "%f,%d:%d:%d", &_vid.gamma, &_vid.wb[0], &_vid.wb[1], &_vid.wb[2]);
+    if ((strncmp(argv[i], "--trace=", 8) == 0) && (trace_open(argv[i]+8) < 0))
+      exit(EXIT_FAILURE);
+    if (strncmp(argv[i], "--replay=", 9) == 0)
+      _rp.path = argv[i]+9;
+  }
+  if (_fps < 1)
+    _fps = 1;
+  if (_window < 1)
+    _window = 1;
+
+  _epfd = epoll_create1(0);
+
+  // replay runs recorded devices against stand-ins (cache files untouched, shadows come from the trace)
+  if (_rp.path != NULL) {
+    _cache = NULL;
+    if (replay_load(_rp.path) < 0)
+      exit(EXIT_FAILURE);
+  }
+
+  // one device per comma-separated bt-addr (- for none)
+  for (char *addr = (strcmp(argv[1], "-") != 0) ? argv[1] : "", *end; *addr != 0; addr = end+(*end != 0)) {
+    end = addr+strcspn(addr, ",");
+    dev_find(addr, end-addr, 1);
+  }
+
+  int argi = 2;
+  _lasttime = now_ms()+1000*((argc >= 3) && (argv[2][0] >= '1') && (argv[2][0] <= '9') ? atoi(argv[argi++]) : 60);
+  int interactive = (argc == 2) || (strcmp(argv[argc-1], "-I") == 0);
+  const char *daemon = NULL;
+  int iter = 0;
+
+  // queue command-line parms for every device (sent once device identified)
+  for (; argi < argc; ++argi) {
+    if (strncmp(argv[argi], "--daemon=", 9) == 0)
+      daemon = argv[argi]+9;
+    else if ((strncmp(argv[argi], "--pipeline", 10) == 0) || (strncmp(argv[argi], "--cache=", 8) == 0) || (strncmp(argv[argi], "--stale=", 8) == 0) ||
+        (strncmp(argv[argi], "--probe=", 8) == 0) || (strncmp(argv[argi], "--fps=", 6) == 0) || (strcmp(argv[argi], "--audio-rgb") == 0) ||
+        (strncmp(argv[argi], "--metrics=", 10) == 0) || (strncmp(argv[argi], "--trace=", 8) == 0) || (strncmp(argv[argi], "--replay=", 9) == 0) ||
+        (strncmp(argv[argi], "--video-cal=", 12) == 0) ||
+        (strncmp(argv[argi], "--reconcile=", 12) == 0))
+      continue;
+    else if (strncmp(argv[argi], "--video=", 8) == 0) {
+      if (video_open(argv[argi]+8) < 0)
+        exit(EXIT_FAILURE);
+      for (int i = 0; i < _ndev; ++i)
+        enqueue(&_dev[i], NULL, "want power=1 mode=1 effect=1");
+    }
+    else if (strncmp(argv[argi], "--audio=", 8) == 0) {
+      // pulses only drive the effect with the pulse command as sound trigger
+      if (audio_open(argv[argi]+8) < 0)
+        exit(EXIT_FAILURE);
+      for (int i = 0; i < _ndev; ++i)
+        enqueue(&_dev[i], NULL, "want mic=1");
+    }
+    else if (strncmp(argv[argi], "--ring=", 7) == 0) {
+      if (ring_open(argv[argi]+7) < 0)
+        exit(EXIT_FAILURE);
+    }
+    else if (strncmp(argv[argi], "--scene=", 8) == 0) {
+      char line[4096];
+      snprintf(line, sizeof(line), "scene %s", argv[argi]+8);
+      trace_put(NULL, TR_REQ, line, strlen(line));
+      scene(NULL, argv[argi]+8);
+    }
+    else if (strncmp(argv[argi], "--bench", 7) == 0)
+      iter = (argv[argi][7] == '=') ? atoi(argv[argi]+8) : 100;
+    else if ((argv[argi][0] == '-') && (argv[argi][1] == '-'))
+      for (int i = 0; i < _ndev; ++i) {
+        trace_put(&_dev[i], TR_REQ, argv[argi]+2, strlen(argv[argi]+2));
+        enqueue(&_dev[i], NULL, argv[argi]+2);
+      }
+  }
+
+  for (int i = 0; i < MAX_CLIENT; ++i)
+    _cl[i].fd = -1;
+
+  // daemon mode listens for requests on unix socket (runs until killed)
+  if (daemon != NULL) {
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", daemon);
+    unlink(sun.sun_path);
+    int lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+    // owner only (requests drive the controllers), created that way so there is no window before a chmod
+    mode_t mask = umask(077);
+    int rc = (lsock < 0) ? -1 : bind(lsock, (struct sockaddr *)&sun, sizeof(sun));
+    umask(mask);
+    if ((rc < 0) || (chmod(sun.sun_path, 0600) < 0) || (listen(lsock, MAX_CLIENT) < 0)) {
+      fprintf(stderr, "daemon error: %s (%d)\n", strerror(errno), errno);
+      exit(EXIT_FAILURE);
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EV_LISTEN|lsock };
+    epoll_ctl(_epfd, EPOLL_CTL_ADD, lsock, &ev);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "daemon listening on %s\n", sun.sun_path);
+    _lasttime = 0;
+  }
+
+  // periodic reconcile and ring producers run until killed, replay until the trace is used up
+  if (((_rc.file != NULL) && (_rc.interval > 0)) || (_ring.r != NULL) || (_rp.buf != NULL))
+    _lasttime = 0;
+
+  // benchmark first device (no timeout)
+  if ((iter > 0) && (_ndev > 0)) {
+    _lasttime = 0;
+    exit(bench(&_dev[0], iter));
+  }
+
+  for (int tty = 0; !_quit && ((_lasttime == 0) || (now_ms() <= _lasttime));) {
+    // if done with commands (and animations unless interactive), exit or enable tty control
+    if (loop() && !tty && (daemon == NULL) && (interactive || (!anim_active() && (_au.fd < 0) && (_ring.r == NULL)))) {
+      if (!interactive)
+        break;
+      fprintf(stderr, "interactive mode (timeout disabled)\n");
+      _lasttime += 86400*1000LL;
+      struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EV_TTY };
+      epoll_ctl(_epfd, EPOLL_CTL_ADD, 0, &ev);
+      tty = 1;
+    }
+    // replay that stops matching ends once nothing has happened for HOLD_TIMEOUT
+    if ((_rp.buf != NULL) && (now_us()-_rp.last >= HOLD_TIMEOUT*1000000LL) && (daemon == NULL) && !interactive)
+      break;
+  }
+
+  int pending = 0;
+  for (int i = 0; i < _ndev; ++i) {
+    pending |= (_dev[i].rqhead != NULL) || (_dev[i].busy != NULL);
+    if (_dev[i].an.kind != ANIM_NONE)
+      anim_stats(&_dev[i], stderr);
+  }
+  if (_au.fd >= 0)
+    audio_stats(stderr);
+  if (_rp.buf != NULL)
+    replay_stats(stderr);
+  if (_metrics != NULL)
+    metrics_file();
+  exit(pending ? EXIT_FAILURE : EXIT_SUCCESS);
+}
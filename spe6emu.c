@@ -0,0 +1,336 @@
+/* spe6emu.c
+ * Copyright 2024 Vraz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+ * FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* notes:
+   software stand-in for the sp630e used to exercise spe6ctrl without hardware
+   compile via: gcc -g -O0 spe6emu.c -o spe6emu
+   each socket-path argument is one controller reached by spe6ctrl as unix:<socket-path>
+   att packets travel over unix seqpacket sockets exactly as they would over l2cap
+   parm memory persists across connections (notify config does not)
+   command 0xfe (spe6ctrl "#0xfe 0") forces a disconnect for recovery testing
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "spe6.h"
+
+#define MAX_EMU 64
+#define MAX_PEND 256
+
+// simulated link quality
+static struct {
+  int latency;       // response delay (ms)
+  int jitter;        // random additional delay (ms)
+  int loss;          // percent of outgoing packets lost
+  int drop;          // percent of requests that end in a disconnect
+  int clean;         // notify bytes delivered intact at default mtu (pdu overrun corrupts the rest)
+  int mtu;           // largest att mtu accepted in exchange (0=no exchange support)
+  int verbose;
+} _opt = { 0, 0, 0, 0, 56, ATT_MAX_MTU, 0 };
+
+// outgoing packet awaiting its simulated delivery time
+struct packet {
+  int64_t time;      // delivery time (ms)
+  int len;           // packet length (0=disconnect)
+  uint8_t buf[256];
+};
+
+// emulated controller
+static struct emu {
+  char path[108];    // listening socket path
+  int lsock;         // listening socket
+  int sock;          // connected central (-1=none)
+  int notify;        // notify enabled via ccc handle
+  int mtu;           // negotiated att mtu
+  struct sp630e sp;  // parm memory
+  int head, tail;    // pending packet ring
+  struct packet out[MAX_PEND];
+} _emu[MAX_EMU];
+static int _nemu = 0;
+
+// monotonic time in ms
+int64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000LL+ts.tv_nsec/1000000;
+}
+
+// factory-like parm memory
+void emu_reset(struct emu *e)
+{
+  const uint8_t rme[] = { 3,1, 3,4, 3,112, 3,146, 3,119, 3,121, 7,1, 7,2, 7,4, 7,17 };
+  struct sp630e *sp = &e->sp;
+  memset(sp, 0, sizeof(*sp));
+  sp->u1[0] = 0x01;
+  memcpy(sp->fw, "V3.0.08", 7);
+  sp->u13[0] = 0x80;
+  sp->oo_effect = 1;
+  sp->oo_speed = 2;
+  sp->oo_len[1] = 150;
+  sp->reboot = 2;
+  sp->u20[0] = 0x02;
+  sp->u21[0] = 0x4b;
+  sp->power = 1;
+  sp->order = 4;
+  sp->mode = 1;
+  sp->effect = 1;
+  sp->level = 255;
+  sp->white = 255;
+  memset(sp->rgb, 255, 3);
+  sp->speed = 5;
+  sp->len = 50;
+  sp->gain = 1;
+  sp->rcnt = sizeof(rme)/2;
+  memcpy(sp->rme, rme, sizeof(rme));
+}
+
+// queue outgoing packet (len 0 disconnects once earlier packets are delivered)
+void emu_send(struct emu *e, const uint8_t *buf, int len)
+{
+  if ((len > 0) && (rand()%100 < _opt.loss))
+    return;
+  if ((e->tail+1)%MAX_PEND == e->head)
+    return;
+  struct packet *pkt = &e->out[e->tail];
+  int64_t last = (e->head != e->tail) ? e->out[(e->tail+MAX_PEND-1)%MAX_PEND].time : 0;
+  pkt->time = now_ms()+_opt.latency+(_opt.jitter ? rand()%_opt.jitter : 0);
+  if (pkt->time < last)
+    pkt->time = last;
+  memcpy(pkt->buf, buf, pkt->len = len);
+  e->tail = (e->tail+1)%MAX_PEND;
+}
+
+// respond with att error
+void emu_error(struct emu *e, const uint8_t *req, uint8_t err)
+{
+  uint8_t rsp[] = { GATT_ERR_RSP, req[0], req[1], req[2], err };
+  emu_send(e, rsp, sizeof(rsp));
+}
+
+// send parm memory as notify segments (width includes 9 header bytes; 0=14-byte segments, 1=single)
+void emu_query(struct emu *e, int width, int drop)
+{
+  int total = 77+e->sp.rcnt*2;
+  int seglen = (width > 9) ? width-9 : (width == 1) ? total : 14;
+  int nseg = (total+seglen-1)/seglen;
+  int cut = drop ? rand()%nseg : nseg;
+  for (int seg = 0, off = 0; (seg < cut) && (off < total); ++seg, off += seglen) {
+    int len = (total-off < seglen) ? total-off : seglen;
+    uint8_t pkt[256] = { GATT_HAND_VAL_NOTIFY, SPE6_HANDLE_CMD, 0x00, 0x53, 0x02, 0x00, 0x01, seg, len };
+    if (9+len > sizeof(pkt))
+      len = sizeof(pkt)-9;
+    memcpy(pkt+9, (const uint8_t *)&e->sp+off, len);
+    for (int i = (e->mtu > _opt.clean) ? e->mtu : _opt.clean; i < 9+len; ++i)
+      pkt[i] = rand();
+    emu_send(e, pkt, 9+len);
+  }
+  if (drop)
+    emu_send(e, NULL, 0);
+}
+
+// handle att request from central
+void emu_request(struct emu *e, const uint8_t *req, int len)
+{
+  if (_opt.verbose) {
+    fprintf(stderr, "%s recv(%d):", e->path, len);
+    for (int i = 0; i < len; ++i)
+      fprintf(stderr, " %02x", req[i]);
+    fprintf(stderr, "\n");
+  }
+  if (len < 3) {
+    emu_error(e, req, 0x04);
+    return;
+  }
+
+  // mtu exchange
+  if (req[0] == GATT_MTU_REQ) {
+    int mtu = req[1]|(req[2] << 8);
+    if (_opt.mtu == 0) {
+      emu_error(e, req, 0x06);
+      return;
+    }
+    e->mtu = (mtu < _opt.mtu) ? mtu : _opt.mtu;
+    if (e->mtu < ATT_DEFAULT_MTU)
+      e->mtu = ATT_DEFAULT_MTU;
+    uint8_t rsp[] = { GATT_MTU_RSP, _opt.mtu & 0xff, _opt.mtu >> 8 };
+    emu_send(e, rsp, sizeof(rsp));
+    return;
+  }
+
+  // identify (0x2902 ccc descriptors)
+  if ((req[0] == GATT_READ_BY_TYPE_REQ) && (len >= 7) && (req[5] == 0x02) && (req[6] == 0x29)) {
+    uint8_t rsp[] = { GATT_READ_BY_TYPE_RSP, 0x04, 0x04, 0x00, 0x00, 0x00, SPE6_HANDLE_CCC, 0x00, e->notify, 0x00, 0x15, 0x00, 0x00, 0x00 };
+    emu_send(e, rsp, sizeof(rsp));
+    return;
+  }
+  if ((req[0] != GATT_WRITE_REQ) && (req[0] != GATT_WRITE_CMD)) {
+    emu_error(e, req, 0x06);
+    return;
+  }
+
+  // notify config
+  int handle = req[1]|(req[2] << 8);
+  const uint8_t rsp[] = { GATT_WRITE_RSP };
+  if ((handle == SPE6_HANDLE_CCC) && (len >= 4)) {
+    e->notify = req[3] & 1;
+    if (req[0] == GATT_WRITE_REQ)
+      emu_send(e, rsp, sizeof(rsp));
+    return;
+  }
+  if ((handle != SPE6_HANDLE_CMD) || (len < 9) || (req[3] != 0x53)) {
+    if (req[0] == GATT_WRITE_REQ)
+      emu_error(e, req, 0x01);
+    return;
+  }
+
+  // command (0x53 code 0x00 0x01 0x00 count parms...)
+  int code = req[4];
+  int cnt = (req[8] < len-9) ? req[8] : len-9;
+  int drop = (rand()%100 < _opt.drop) || (code == 0xfe);
+  if (req[0] == GATT_WRITE_REQ)
+    emu_send(e, rsp, sizeof(rsp));
+  if (code == 0x02) {
+    if (e->notify)
+      emu_query(e, (cnt > 0) ? req[9] : 0, drop);
+    else if (drop)
+      emu_send(e, NULL, 0);
+    return;
+  }
+  sp630e_apply(&e->sp, code, req+9, cnt);
+  if (drop)
+    emu_send(e, NULL, 0);
+}
+
+// drop central connection
+void emu_close(struct emu *e)
+{
+  if (e->sock >= 0)
+    close(e->sock);
+  if (_opt.verbose)
+    fprintf(stderr, "%s disconnect\n", e->path);
+  e->sock = -1;
+  e->notify = 0;
+  e->mtu = ATT_DEFAULT_MTU;
+  e->head = e->tail = 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int seed = time(NULL);
+  for (int i = 1; i < argc; ++i) {
+    if (sscanf(argv[i], "--latency=%d:%d", &_opt.latency, &_opt.jitter) >= 1)
+      continue;
+    if (sscanf(argv[i], "--loss=%d", &_opt.loss) == 1)
+      continue;
+    if (sscanf(argv[i], "--drop=%d", &_opt.drop) == 1)
+      continue;
+    if (sscanf(argv[i], "--clean=%d", &_opt.clean) == 1)
+      continue;
+    if (sscanf(argv[i], "--mtu=%d", &_opt.mtu) == 1)
+      continue;
+    if (sscanf(argv[i], "--seed=%d", &seed) == 1)
+      continue;
+    if (strcmp(argv[i], "-v") == 0) {
+      ++_opt.verbose;
+      continue;
+    }
+    if ((argv[i][0] == '-') || (_nemu >= MAX_EMU))
+      continue;
+
+    struct emu *e = &_emu[_nemu++];
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(e->path, sizeof(e->path), "%s", argv[i]);
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", argv[i]);
+    unlink(addr.sun_path);
+    e->sock = -1;
+    e->mtu = ATT_DEFAULT_MTU;
+    e->lsock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if ((e->lsock < 0) || (bind(e->lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(e->lsock, 4) < 0)) {
+      fprintf(stderr, "%s: %s (%d)\n", argv[i], strerror(errno), errno);
+      exit(EXIT_FAILURE);
+    }
+    emu_reset(e);
+  }
+  if (_nemu == 0) {
+    fprintf(stderr, "usage: %s [--latency=ms[:jitter]] [--loss=pct] [--drop=pct] [--clean=bytes] [--mtu=bytes] [--seed=n] [-v] socket-path [socket-path ...]\n", argv[0]);
+    exit(0);
+  }
+  srand(seed);
+  signal(SIGPIPE, SIG_IGN);
+
+  for (;;) {
+    // wait for requests (or next pending delivery)
+    struct pollfd pfd[MAX_EMU*2];
+    int64_t now = now_ms(), next = now+1000;
+    for (int i = 0; i < _nemu; ++i) {
+      pfd[i*2+0] = (struct pollfd) { .fd = _emu[i].lsock, .events = POLLIN };
+      pfd[i*2+1] = (struct pollfd) { .fd = _emu[i].sock, .events = POLLIN };
+      if ((_emu[i].head != _emu[i].tail) && (_emu[i].out[_emu[i].head].time < next))
+        next = _emu[i].out[_emu[i].head].time;
+    }
+    if (poll(pfd, _nemu*2, (next > now) ? next-now : 0) < 0)
+      continue;
+
+    for (int i = 0; i < _nemu; ++i) {
+      struct emu *e = &_emu[i];
+
+      // controller holds one link (newer central replaces older)
+      if (pfd[i*2+0].revents) {
+        int sock = accept(e->lsock, NULL, NULL);
+        if (sock >= 0) {
+          emu_close(e);
+          e->sock = sock;
+          if (_opt.verbose)
+            fprintf(stderr, "%s connect\n", e->path);
+        }
+      }
+      if (pfd[i*2+1].revents && (e->sock == pfd[i*2+1].fd)) {
+        uint8_t req[512];
+        int len = read(e->sock, req, sizeof(req));
+        if (len <= 0)
+          emu_close(e);
+        else
+          emu_request(e, req, len);
+      }
+
+      // deliver packets whose time has come
+      for (now = now_ms(); (e->sock >= 0) && (e->head != e->tail) && (e->out[e->head].time <= now); ) {
+        struct packet *pkt = &e->out[e->head];
+        e->head = (e->head+1)%MAX_PEND;
+        if (pkt->len == 0) {
+          emu_close(e);
+          break;
+        }
+        send(e->sock, pkt->buf, pkt->len, 0);
+      }
+    }
+  }
+}
@@ -3,12 +3,16 @@ use strict;
 use warnings;
 
 # simplistic http wrapper for spe6ctrl supporting basic automation primitives:
+# (--sock=<path> sends requests to "spe6ctrl --daemon=<path>" rather than running spe6ctrl per request)
 # set=0..100 (absolute intensity), dec=0..100 (decrease brightness), inc=0..100 (increase brightness),
 # rgb=0..255:0..255:0..255:0..100 set color/intensity, pat=(dynamic|music|custom):parms
+# (a comma-separated group of addresses as path applies rgb/pat to every strip at once via the daemon scene command)
 
 # core modules
 use POSIX;
 use Data::Dumper;
+use IO::Select;
+use IO::Socket::UNIX;
 
 # parse command line
 my ($opt1,@parm,%opts) = ("");
@@ -44,11 +48,43 @@ $SIG{INT} = sub { kill("TERM", 0) };
 END { (defined $ctrl_out) && kill("TERM", 0) };
 
 # fork worker (run until killed)
+# with --sock, requests go to a running "spe6ctrl --daemon" holding the connection(s)
+# (sent as they arrive so the daemon can merge superseded commands, results read as they complete)
 if (fork() == 0) {
-  while (my $exec = <$ctrl_inp>) {
-    print ">$exec";
-    my $r = system(split(" ",$exec));
-    print ">result=$r\n";
+  my ($sock,$inp,$out) = (undef,"","");
+  my $sel = IO::Select->new($ctrl_inp);
+  for (;;) {
+    for my $fh ($sel->can_read()) {
+      if ($fh != $ctrl_inp) {
+        if (sysread($sock,$out,4096,length($out)) <= 0) {
+          $sel->remove($sock);
+          undef($sock);
+        }
+        while ($out =~ s/^(.*\n)//) {
+          my $r = $1;
+          ($r =~ /^(ok|err) /) && print(">result=$r");
+        }
+        next;
+      }
+      (sysread($ctrl_inp,$inp,4096,length($inp)) > 0) || exit;
+      while ($inp =~ s/^(.*\n)//) {
+        my $exec = $1;
+        print ">$exec";
+        if (!defined $opts{sock}) {
+          my $r = system(split(" ",$exec));
+          print ">result=$r\n";
+          next;
+        }
+        my ($ctrl,$base,$cmd) = split(" ",$exec,3);
+        chomp($cmd);
+        if (!defined $sock) {
+          $sock = IO::Socket::UNIX->new(Type=>SOCK_STREAM, Peer=>$opts{sock});
+          (defined $sock) || (print(">result=no daemon ($!)\n"), next);
+          $sel->add($sock);
+        }
+        print $sock join("", map { "$base $_\n" } split(/\s+(?=--)/,$cmd));
+      }
+    }
   }
 }
 
@@ -57,21 +93,22 @@ sub request
 {
   my ($line,$path,$base,$extn,$parm,$head,$body) = @_;
   print "base=$base parm=$parm\n";
-  (defined $blid{$base}) || return("400 Bad Request (Invalid BLID)");
+  my @group = split(",", $base);
+  ((@group > 0) && !grep { !defined $blid{$_} } @group) || return("400 Bad Request (Invalid BLID)");
   ($parm =~ /^[a-z0-9_=&:]+$/) || return("400 Bad Request (Malformed Query)");
   (-x $opts{ctrl}) || return("400 Bad Request (Server Misconfig)");
 
   my ($cmd,$val);
   my %opt = map { split("=",$_,2) } split("&", $parm);
-  if (($line =~ /^GET /) && (defined $blid{$base})) {
+  if ($line =~ /^GET /) {
     $val = $level{$opt{set}//""}//"";
-    ($val ne "") && ($cmd = "--power=1 --set=$val");
-    ($val eq "0") && ($cmd = "--power=0");
+    ($val ne "") && ($cmd = "--want=power=1,level=$val");
+    ($val eq "0") && ($cmd = "--want=power=0");
     $val = $level{$opt{inc}//""}//"";
-    ($val =~ /^[1-9]/) && ($cmd = "--power=1 --inc=$val");
+    ($val =~ /^[1-9]/) && ($cmd = "--want=power=1 --inc=$val");
     $val = $level{$opt{dec}//""}//"";
     ($val ne "") && ($cmd = "--dec=$val");
-    ($val eq "0") && ($cmd = "--power=0");
+    ($val eq "0") && ($cmd = "--want=power=0");
     # for rgb, set level as component average to enable subsequent intensity-only changes 
     $val = $opt{rgb}//"";
     if (($val =~ /^(\d+):(\d+):(\d+):(\d+)$/) && (defined $level{$4})) {
@@ -80,13 +117,25 @@ sub request
       my $r = int(($i*$1)/$max[0]);
       my $g = int(($i*$2)/$max[0]);
       my $b = int(($i*$3)/$max[0]);
-      $cmd = "--power=1 --rgb=$r:$g:$b:$i --mode=1:1";
+      # (spe6ctrl only sends what differs from the controller's current state)
+      $cmd = sprintf("--want=power=1,mode=1,effect=1,rgb=%02x:%02x:%02x,level=%d", $r, $g, $b, $i);
     }
-    ($val eq "0:0:0") && ($cmd = "--power=0");
+    ($val eq "0:0:0") && ($cmd = "--want=power=0");
     $val = $opt{pat}//"";
     (length($val) < 1024) && ($val =~ s/^(dynamic|music|custom)://) && ($cmd = "--power=1 --$1='$val'");
     (defined $cmd) || return("404 Not Found (Invalid Request)");
 
+    # group: one staged write fired on every strip together (without daemon, one run connecting to all)
+    if (@group > 1) {
+      my $one;
+      (($val = $opt{rgb}//"") =~ /^(\d+):(\d+):(\d+):(\d+)$/) && ($cmd =~ /rgb=(..):(..):(..)/) &&
+        ($one = sprintf("static %d:%d:%d", hex($1), hex($2), hex($3)));
+      (($val = $opt{pat}//"") =~ /^(dynamic|music|custom):(.*)$/) && ($one = "$1 $2");
+      (defined $one) || return("404 Not Found (Group Request Must Be rgb Or pat)");
+      ($one =~ s/ /=/) if (!defined $opts{sock});
+      print $ctrl_out (defined $opts{sock}) ? "$opts{ctrl} scene $base $one\n" : "$opts{ctrl} $base --$one\n";
+      return("200 OK (Request Queued)", "term", "");
+    }
     print $ctrl_out "$opts{ctrl} $base $cmd\n";
     return("200 OK (Request Queued)", "term", "");
   }